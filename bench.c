@@ -0,0 +1,1141 @@
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <linux/perf_event.h>
+#include <errno.h>
+
+#include "pcomm.h"
+#include "simclist.h"
+
+#define MICROSECOND    (int64_t)1000LL
+#define MILLISECOND (int64_t)1000000LL
+#define SECOND   (int64_t)1000000000LL
+
+#define MAX_SAMPLES 64
+
+#define COLOR_OFF     "\x1B[0m"
+#define COLOR_RED     "\x1B[31m"
+#define COLOR_GREEN   "\x1B[32m"
+#define COLOR_YELLOW  "\x1B[33m"
+#define COLOR_BLUE    "\x1B[34m"
+
+// Hardware counters read around each case with perf_event_open, -p.
+enum bench_counter {
+  COUNTER_CYCLES = 0,
+  COUNTER_INSTRUCTIONS,
+  COUNTER_CACHE_MISSES,
+  COUNTER_BRANCH_MISSES,
+  COUNTERS
+};
+
+const char *counter_names[COUNTERS] = { "cycles", "instructions", "cache_misses", "branch_misses" };
+
+// The counters follow the whole process, including threads started later,
+// and accumulate between counters_start and counters_stop.
+struct bench_counters {
+  int enabled;
+  int kernel;                 // kernel time is counted too
+  int fds[COUNTERS];          // -1 for a counter the machine lacks
+  uint64_t started[COUNTERS];
+  uint64_t counted[COUNTERS];
+} counters = { .enabled = 0 };
+
+// Every run of one case, for means and confidence intervals.
+struct bench_series {
+  char name[64];
+  int samples;
+  double ns_per_op[MAX_SAMPLES];
+  double p99_ns[MAX_SAMPLES];     // empty unless the case records latency
+  int has_latency;
+  double ops_per_sec;             // of the last run, for the JSON
+  double allocs_per_op;           // of the last run, -1 when not counted
+  int has_counters;
+  double counters_per_op[COUNTERS];   // of the last run, -1 when unavailable
+};
+
+// Options shared by every benchmark.
+struct bench_context {
+  const char *filter;   // run only cases whose name contains this
+  int quick;            // cut iteration counts for a smoke run
+  int large;            // include the 10M-element simclist cases
+  int ran;
+  int repeats;          // times the whole suite runs
+  double threshold;     // relative change below which nothing is flagged
+  struct bench_series *series;
+  int series_count;
+  int series_capacity;
+};
+
+// What one benchmark case measured.
+struct bench_result {
+  const char *name;
+  uint64_t ops;                   // operations completed
+  int64_t elapsed_ns;             // wall time for all of them
+  int64_t cpu_ns;                 // process CPU time, 0 when not measured
+  int counts_allocations;         // allocations below is meaningful
+  uint64_t allocations;           // malloc/calloc/realloc calls made
+  uint64_t bytes;                 // payload moved, 0 when not meaningful
+  pcomm_histogram_t *latency;     // per-operation latency, may be NULL
+};
+
+// Allocation counting. The benchmark binaries are linked with --wrap for
+// malloc, calloc and realloc, so every allocation made by the library or by
+// simclist is counted here on its way to the C library.
+uint64_t allocations = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+
+void *__wrap_malloc(size_t size) {
+  __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+  __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+  return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *pointer, size_t size) {
+  __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+  return __real_realloc(pointer, size);
+}
+
+int open_counter(uint64_t config, int exclude_kernel) {
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = config;
+  attr.disabled = 0;
+  attr.inherit = 1;
+  attr.exclude_kernel = exclude_kernel;
+  attr.exclude_hv = 1;
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// Opens the counters before any benchmark thread exists so they inherit
+// them. Without a PMU or permission the harness carries on without them.
+void counters_open(void) {
+  uint64_t configs[COUNTERS] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                 PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+  int i;
+
+  // user and kernel if allowed, user only under a stricter perf_event_paranoid
+  counters.kernel = 1;
+  if ((counters.fds[0] = open_counter(configs[0], 0)) < 0 && (errno == EACCES || errno == EPERM)) {
+    counters.kernel = 0;
+    counters.fds[0] = open_counter(configs[0], 1);
+  }
+  if (counters.fds[0] < 0) {
+    printf("%sHardware counters unavailable: %s%s\n", COLOR_YELLOW, strerror(errno), COLOR_OFF);
+    return;
+  }
+  for (i = 1; i < COUNTERS; i++) {
+    counters.fds[i] = open_counter(configs[i], !counters.kernel);
+  }
+  counters.enabled = 1;
+}
+
+uint64_t counter_value(int fd) {
+  uint64_t value = 0;
+
+  if (fd >= 0 && read(fd, &value, sizeof(value)) != sizeof(value)) {
+    value = 0;
+  }
+  return value;
+}
+
+void counters_reset(void) {
+  memset(counters.counted, 0, sizeof(counters.counted));
+}
+
+void counters_start(void) {
+  int i;
+
+  for (i = 0; counters.enabled && i < COUNTERS; i++) {
+    counters.started[i] = counter_value(counters.fds[i]);
+  }
+}
+
+void counters_stop(void) {
+  int i;
+
+  for (i = 0; counters.enabled && i < COUNTERS; i++) {
+    counters.counted[i] += counter_value(counters.fds[i]) - counters.started[i];
+  }
+}
+
+// Supplies a monotonic timestamp in nanoseconds.
+int64_t get_nano_timestamp(void) {
+  struct timespec spec;
+
+  clock_gettime(CLOCK_MONOTONIC, &spec);
+  return SECOND * (int64_t)(spec.tv_sec) + (int64_t)(spec.tv_nsec);
+}
+
+// Formats a nanosecond duration with a unit that keeps it readable.
+const char *format_nanos(char *text, size_t size, uint64_t nanos) {
+  if (nanos >= (uint64_t)SECOND) {
+    snprintf(text, size, "%.2fs", (double)nanos / SECOND);
+  } else if (nanos >= (uint64_t)MILLISECOND) {
+    snprintf(text, size, "%.2fms", (double)nanos / MILLISECOND);
+  } else if (nanos >= (uint64_t)MICROSECOND) {
+    snprintf(text, size, "%.2fus", (double)nanos / MICROSECOND);
+  } else {
+    snprintf(text, size, "%" PRIu64 "ns", nanos);
+  }
+  return text;
+}
+
+// Supplies the CPU time used by the whole process in nanoseconds.
+int64_t get_cpu_timestamp(void) {
+  struct timespec spec;
+
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &spec);
+  return SECOND * (int64_t)(spec.tv_sec) + (int64_t)(spec.tv_nsec);
+}
+
+// Decides whether a case is selected by the command line filter.
+int selected(struct bench_context *b, const char *name) {
+  return !b->filter || strstr(name, b->filter);
+}
+
+// Finds the series for a case name, adding it on first use.
+struct bench_series *find_series(struct bench_series **series, int *count, int *capacity,
+                                 const char *name) {
+  struct bench_series *grown;
+  int i;
+
+  for (i = 0; i < *count; i++) {
+    if (!strcmp((*series)[i].name, name)) {
+      return &(*series)[i];
+    }
+  }
+  if (*count == *capacity) {
+    *capacity = *capacity ? *capacity * 2 : 64;
+    if (!(grown = realloc(*series, *capacity * sizeof(struct bench_series)))) {
+      return NULL;
+    }
+    *series = grown;
+  }
+  memset(&(*series)[*count], 0, sizeof(struct bench_series));
+  snprintf((*series)[*count].name, sizeof((*series)[*count].name), "%s", name);
+  return &(*series)[(*count)++];
+}
+
+// Keeps the numbers of one run for the summary, JSON and comparison.
+void record_sample(struct bench_context *b, struct bench_result *r) {
+  struct bench_series *series;
+  double seconds = (double)r->elapsed_ns / SECOND;
+  int i;
+
+  series = find_series(&b->series, &b->series_count, &b->series_capacity, r->name);
+  if (!series || series->samples == MAX_SAMPLES) {
+    return;
+  }
+  series->ns_per_op[series->samples] = r->ops ? (double)r->elapsed_ns / r->ops : 0.0;
+  if (r->latency && r->latency->count) {
+    series->has_latency = 1;
+    series->p99_ns[series->samples] = (double)pcomm_histogram_percentile(r->latency, 99.0);
+  }
+  series->ops_per_sec = seconds > 0 ? r->ops / seconds : 0.0;
+  series->allocs_per_op = r->counts_allocations && r->ops ? (double)r->allocations / r->ops : -1.0;
+  series->has_counters = counters.enabled;
+  for (i = 0; i < COUNTERS; i++) {
+    series->counters_per_op[i] = counters.enabled && counters.fds[i] >= 0 && r->ops ?
+                                 (double)counters.counted[i] / r->ops : -1.0;
+  }
+  series->samples++;
+}
+
+// Prints one result line: rate, cost per operation and latency percentiles.
+void report(struct bench_context *b, struct bench_result *r) {
+  char p50[16], p90[16], p99[16], p999[16], max[16];
+  double seconds = (double)r->elapsed_ns / SECOND;
+
+  b->ran++;
+  record_sample(b, r);
+  printf("%s%-38s%s %12.0f ops/s %9.1f ns/op", COLOR_BLUE, r->name, COLOR_OFF,
+         seconds > 0 ? r->ops / seconds : 0.0,
+         r->ops ? (double)r->elapsed_ns / r->ops : 0.0);
+  if (r->cpu_ns) {
+    printf(" %9.1f cpu ns/op", r->ops ? (double)r->cpu_ns / r->ops : 0.0);
+  }
+  if (r->counts_allocations) {
+    printf(" %6.2f allocs/op", r->ops ? (double)r->allocations / r->ops : 0.0);
+  }
+  if (r->bytes) {
+    printf(" %9.1f MB/s", seconds > 0 ? r->bytes / seconds / 1e6 : 0.0);
+  }
+  if (counters.enabled && r->ops) {
+    printf(" %8.0f cyc/op", (double)counters.counted[COUNTER_CYCLES] / r->ops);
+    if (counters.counted[COUNTER_CYCLES]) {
+      printf(" IPC %.2f", (double)counters.counted[COUNTER_INSTRUCTIONS] /
+                          counters.counted[COUNTER_CYCLES]);
+    }
+    if (counters.fds[COUNTER_CACHE_MISSES] >= 0) {
+      printf(" %7.2f cache-miss/op", (double)counters.counted[COUNTER_CACHE_MISSES] / r->ops);
+    }
+    if (counters.fds[COUNTER_BRANCH_MISSES] >= 0) {
+      printf(" %7.2f br-miss/op", (double)counters.counted[COUNTER_BRANCH_MISSES] / r->ops);
+    }
+  }
+  if (r->latency && r->latency->count) {
+    printf("  p50 %s p90 %s p99 %s p99.9 %s max %s",
+           format_nanos(p50, sizeof(p50), pcomm_histogram_percentile(r->latency, 50.0)),
+           format_nanos(p90, sizeof(p90), pcomm_histogram_percentile(r->latency, 90.0)),
+           format_nanos(p99, sizeof(p99), pcomm_histogram_percentile(r->latency, 99.0)),
+           format_nanos(p999, sizeof(p999), pcomm_histogram_percentile(r->latency, 99.9)),
+           format_nanos(max, sizeof(max), r->latency->max));
+  }
+  printf("\n");
+}
+
+// One end of a ping-pong: reads whole messages from in and answers on out.
+struct ping_side {
+  pcomm_context_t context;
+  int in;
+  int out;
+  int close_out;          // shut down out rather than close it when done
+  uint8_t *message;
+  size_t size;
+  size_t received;        // bytes of the current message seen so far
+  uint64_t round_trips;   // client: completed, echo: messages answered
+  uint64_t target;        // client: round trips to run
+  int64_t sent_at;
+  pcomm_histogram_t latency;
+};
+
+void on_echo_data(pcomm_context_t *context, int fd, uint8_t *data, size_t length) {
+  struct ping_side *side = (struct ping_side *)pcomm_get_external_context(context);
+
+  side->received += length;
+  while (side->received >= side->size) {
+    side->received -= side->size;
+    side->round_trips++;
+    pcomm_add_write_fd(context, side->out, side->message, side->size, NULL, NULL);
+  }
+}
+
+void on_client_data(pcomm_context_t *context, int fd, uint8_t *data, size_t length) {
+  struct ping_side *side = (struct ping_side *)pcomm_get_external_context(context);
+  int64_t now;
+
+  side->received += length;
+  if (side->received < side->size) {
+    return;
+  }
+  now = get_nano_timestamp();
+  side->received -= side->size;
+  side->round_trips++;
+  pcomm_histogram_record(&side->latency, (uint64_t)(now - side->sent_at));
+
+  if (side->round_trips < side->target) {
+    side->sent_at = now;
+    pcomm_add_write_fd(context, side->out, side->message, side->size, NULL, NULL);
+  } else {
+    // the echo side sees end of file and its loop runs out of descriptors
+    if (side->close_out) {
+      shutdown(side->out, SHUT_WR);
+    } else {
+      close(side->out);
+    }
+    pcomm_stop(context, 0);
+  }
+}
+
+void *run_echo(void *arg) {
+  struct ping_side *echo = (struct ping_side *)arg;
+
+  pcomm_main(&echo->context);
+  return NULL;
+}
+
+// Runs one ping-pong between a client on this thread and an echo thread.
+// client_fds and echo_fds are {read, write}; they are the same descriptor
+// for a socketpair.
+void ping_pong(struct bench_context *b, const char *name, int client_fds[2], int echo_fds[2],
+               int socket_pair, size_t size, uint64_t busy_poll_us) {
+  struct ping_side client;
+  struct ping_side echo;
+  struct bench_result result;
+  pthread_t thread;
+  int64_t started;
+
+  memset(&client, 0, sizeof(client));
+  memset(&echo, 0, sizeof(echo));
+  client.message = calloc(size, 1);
+  echo.message = calloc(size, 1);
+  client.size = echo.size = size;
+  client.in = client_fds[0];
+  client.out = client_fds[1];
+  client.close_out = socket_pair;
+  client.target = b->quick ? 2000 : 20000;
+  echo.in = echo_fds[0];
+  echo.out = echo_fds[1];
+
+  pcomm_init(&client.context);
+  pcomm_init(&echo.context);
+  pcomm_set_external_context(&client.context, &client);
+  pcomm_set_external_context(&echo.context, &echo);
+  pcomm_set_blocking(&client.context, 1);
+  pcomm_set_blocking(&echo.context, 1);
+  if (busy_poll_us) {
+    pcomm_set_busy_poll(&client.context, busy_poll_us);
+    pcomm_set_busy_poll(&echo.context, busy_poll_us);
+  }
+  pcomm_add_read_fd(&client.context, client.in, on_client_data, NULL);
+  pcomm_add_read_fd(&echo.context, echo.in, on_echo_data, NULL);
+  pthread_create(&thread, NULL, run_echo, &echo);
+
+  counters_reset();
+  counters_start();
+  started = get_nano_timestamp();
+  client.sent_at = started;
+  pcomm_add_write_fd(&client.context, client.out, client.message, size, NULL, NULL);
+  pcomm_main(&client.context);
+  // the echo thread's counts join ours when it exits
+  pthread_join(thread, NULL);
+  counters_stop();
+
+  memset(&result, 0, sizeof(result));
+  result.name = name;
+  result.elapsed_ns = get_nano_timestamp() - started;
+  result.ops = client.round_trips;
+  result.bytes = client.round_trips * size * 2;
+  result.latency = &client.latency;
+  report(b, &result);
+
+  pcomm_destroy(&client.context);
+  pcomm_destroy(&echo.context);
+  free(client.message);
+  free(echo.message);
+}
+
+// Round trips through pcomm_add_write_fd/pcomm_add_read_fd over pipes and
+// socketpairs, across message sizes. Both loops block in select, with and
+// without busy polling; the default zero-timeout mode would only measure
+// how the two spinning threads share the CPUs.
+void bench_ping_pong(struct bench_context *b) {
+  size_t sizes[] = { 64, 1024, 16384 };
+  const char *transports[] = { "pipe", "socketpair" };
+  uint64_t busy_polls[] = { 0, 50 };
+  int client_fds[2], echo_fds[2];
+  int ping[2], pong[2], pair[2];
+  char name[64];
+  int transport;
+  int poll;
+  int i;
+
+  for (transport = 0; transport < 2; transport++) {
+    for (poll = 0; poll < 2; poll++) {
+      for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+        snprintf(name, sizeof(name), "ping-pong/%s/%zuB%s", transports[transport], sizes[i],
+                 busy_polls[poll] ? "/busy-poll" : "");
+        if (!selected(b, name)) {
+          continue;
+        }
+        if (transport == 0) {
+          pipe(ping);
+          pipe(pong);
+          client_fds[0] = pong[0];
+          client_fds[1] = ping[1];
+          echo_fds[0] = ping[0];
+          echo_fds[1] = pong[1];
+          ping_pong(b, name, client_fds, echo_fds, 0, sizes[i], busy_polls[poll]);
+          close(ping[0]);
+          close(pong[0]);
+          close(pong[1]);
+        } else {
+          socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+          client_fds[0] = client_fds[1] = pair[0];
+          echo_fds[0] = echo_fds[1] = pair[1];
+          ping_pong(b, name, client_fds, echo_fds, 1, sizes[i], busy_polls[poll]);
+          close(pair[0]);
+          close(pair[1]);
+        }
+      }
+    }
+  }
+}
+
+// Many registered socketpairs of which only a few ever carry data.
+struct idle_fleet {
+  int (*pairs)[2];
+  int *active;          // indexes into pairs that get traffic
+  int active_count;
+  int next;             // next active pair to poke
+  uint64_t events;
+  uint64_t target;
+};
+
+// Pokes one active connection per pass so every iteration has one event.
+void on_fleet_prepare(pcomm_context_t *context) {
+  struct idle_fleet *fleet = (struct idle_fleet *)pcomm_get_external_context(context);
+  int pair = fleet->active[fleet->next++ % fleet->active_count];
+
+  write(fleet->pairs[pair][1], "x", 1);
+}
+
+void on_fleet_data(pcomm_context_t *context, int fd, uint8_t *data, size_t length) {
+  struct idle_fleet *fleet = (struct idle_fleet *)pcomm_get_external_context(context);
+
+  fleet->events += length;
+  if (fleet->events >= fleet->target) {
+    pcomm_set_prepare_callback(context, NULL);
+    pcomm_stop(context, 0);
+  }
+}
+
+// Loop cost as idle descriptors pile up: 1% of the pairs (at least one) are
+// active and one of them is poked per pass, so any growth in cost per event
+// is the price of the idle ones. select cannot watch descriptors numbered
+// FD_SETSIZE or above, so larger fleets are skipped.
+void bench_idle_scaling(struct bench_context *b) {
+  int counts[] = { 100, 250, 500, 1000, 10000, 50000 };
+  int limit = (FD_SETSIZE - 32) / 2;
+  struct idle_fleet fleet;
+  struct bench_result result;
+  pcomm_context_t context;
+  pcomm_context_t *c = &context;
+  pcomm_histogram_t iteration;
+  char name[64];
+  int64_t started, cpu_started;
+  int capped = 0;
+  int count;
+  int i, j;
+
+  for (i = 0; i < (int)(sizeof(counts) / sizeof(counts[0])); i++) {
+    snprintf(name, sizeof(name), "idle-scaling/%d", counts[i]);
+    if (!selected(b, name)) {
+      continue;
+    }
+    count = counts[i];
+    if (count > limit) {
+      // measure the largest fleet select can take once, skip the rest
+      if (capped) {
+        printf("%-38s skipped, select watches at most %d descriptors\n", name, FD_SETSIZE);
+        continue;
+      }
+      count = limit;
+      capped = 1;
+      snprintf(name, sizeof(name), "idle-scaling/%d", count);
+    }
+
+    memset(&fleet, 0, sizeof(fleet));
+    fleet.pairs = calloc(count, sizeof(fleet.pairs[0]));
+    fleet.active_count = count / 100 > 0 ? count / 100 : 1;
+    fleet.active = calloc(fleet.active_count, sizeof(int));
+    fleet.target = b->quick ? 2000 : 20000;
+    pcomm_init(c);
+    pcomm_set_blocking(c, 1);
+    pcomm_set_external_context(c, &fleet);
+    for (j = 0; j < count; j++) {
+      socketpair(AF_UNIX, SOCK_STREAM, 0, fleet.pairs[j]);
+      pcomm_add_read_fd(c, fleet.pairs[j][0], on_fleet_data, NULL);
+    }
+    // spread the active pairs over the fleet rather than bunching them
+    for (j = 0; j < fleet.active_count; j++) {
+      fleet.active[j] = (int)((int64_t)j * count / fleet.active_count);
+    }
+    pcomm_set_prepare_callback(c, on_fleet_prepare);
+    pcomm_set_histograms(c, 1);
+
+    counters_reset();
+    counters_start();
+    started = get_nano_timestamp();
+    cpu_started = get_cpu_timestamp();
+    pcomm_main(c);
+    counters_stop();
+    memset(&result, 0, sizeof(result));
+    result.cpu_ns = get_cpu_timestamp() - cpu_started;
+    result.elapsed_ns = get_nano_timestamp() - started;
+    pcomm_get_histogram(c, PCOMM_HIST_ITERATION, &iteration);
+    result.name = name;
+    result.ops = fleet.events;
+    result.latency = &iteration;
+    report(b, &result);
+
+    pcomm_destroy(c);
+    for (j = 0; j < count; j++) {
+      close(fleet.pairs[j][0]);
+      close(fleet.pairs[j][1]);
+    }
+    free(fleet.pairs);
+    free(fleet.active);
+  }
+}
+
+// Time and allocations spent inside simclist, accumulated over one or more
+// stretches so setup between them is left out.
+struct list_timing {
+  int64_t started;
+  int64_t elapsed_ns;
+  uint64_t allocations;
+};
+
+void list_timing_reset(struct list_timing *timing) {
+  memset(timing, 0, sizeof(struct list_timing));
+  counters_reset();
+}
+
+void list_timing_start(struct list_timing *timing) {
+  timing->allocations -= __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+  counters_start();
+  timing->started = get_nano_timestamp();
+}
+
+void list_timing_stop(struct list_timing *timing) {
+  timing->elapsed_ns += get_nano_timestamp() - timing->started;
+  counters_stop();
+  timing->allocations += __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+}
+
+// Builds the case name, e.g. simclist/seek/1000.
+const char *list_case(char *name, size_t size, const char *operation, unsigned int elements) {
+  snprintf(name, size, "simclist/%s/%u", operation, elements);
+  return name;
+}
+
+void list_timing_report(struct bench_context *b, struct list_timing *timing, const char *operation,
+                        unsigned int elements, uint64_t ops) {
+  struct bench_result result;
+  char name[64];
+
+  if (!selected(b, list_case(name, sizeof(name), operation, elements))) {
+    return;
+  }
+  memset(&result, 0, sizeof(result));
+  result.name = name;
+  result.ops = ops;
+  result.elapsed_ns = timing->elapsed_ns;
+  result.allocations = timing->allocations;
+  result.counts_allocations = 1;
+  report(b, &result);
+}
+
+int list_wanted(struct bench_context *b, const char *operation, unsigned int elements) {
+  char name[64];
+
+  return selected(b, list_case(name, sizeof(name), operation, elements));
+}
+
+// Deterministic xorshift so every run sees the same positions.
+uint32_t next_random(uint32_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+int seek_int32(const void *element, const void *indicator) {
+  return *(const int32_t *)element == *(const int32_t *)indicator;
+}
+
+// Operations bounded by how much of the list each one walks, so the larger
+// sizes still finish in seconds.
+uint64_t scaled_ops(unsigned int size, uint64_t work) {
+  uint64_t ops = work / size;
+
+  return ops < 10 ? 10 : (ops > 100000 ? 100000 : ops);
+}
+
+void fill_list(list_t *list, int32_t *values, unsigned int size) {
+  unsigned int i;
+
+  list_init(list);
+  list_attributes_comparator(list, list_comparator_int32_t);
+  list_attributes_seeker(list, seek_int32);
+  list_attributes_hash_computer(list, list_hashcomputer_int32_t);
+  list_attributes_copy(list, list_meter_int32_t, 0);
+  for (i = 0; i < size; i++) {
+    list_append(list, &values[i]);
+  }
+}
+
+// ns and allocations per operation for the simclist calls pcomm's registries
+// rest on. Elements are int32 values referenced in place; sort, hash, dump
+// and restore are reported per element.
+void bench_simclist(struct bench_context *b) {
+  unsigned int sizes[] = { 10, 100, 1000, 10000, 100000, 1000000, 10000000 };
+#ifdef SIMCLIST_WITH_THREADS
+  const char *sort_name = "sort-threaded";
+#else
+  const char *sort_name = "sort";
+#endif
+  struct list_timing timing;
+  list_t list;
+  list_t restored;
+  list_hash_t hash;
+  int32_t *values;
+  int32_t wanted;
+  uint32_t state;
+  unsigned int size;
+  uint64_t ops, op;
+  size_t length;
+  FILE *dump;
+  int i;
+  unsigned int j;
+
+  for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+    size = sizes[i];
+    if ((b->quick && size > 100000) || (!b->large && size > 1000000)) {
+      break;
+    }
+
+    state = 2463534242u;
+    values = malloc(size * sizeof(int32_t));
+    for (j = 0; j < size; j++) {
+      values[j] = (int32_t)j;
+    }
+
+    // append builds the list everything else works on
+    list_timing_reset(&timing);
+    list_timing_start(&timing);
+    fill_list(&list, values, size);
+    list_timing_stop(&timing);
+    list_timing_report(b, &timing, "append", size, size);
+
+    if (list_wanted(b, "get_at", size)) {
+      ops = scaled_ops(size, 20000000);
+      list_timing_reset(&timing);
+      list_timing_start(&timing);
+      for (op = 0; op < ops; op++) {
+        list_get_at(&list, next_random(&state) % size);
+      }
+      list_timing_stop(&timing);
+      list_timing_report(b, &timing, "get_at", size, ops);
+    }
+
+    if (list_wanted(b, "seek", size)) {
+      ops = scaled_ops(size, 10000000);
+      list_timing_reset(&timing);
+      list_timing_start(&timing);
+      for (op = 0; op < ops; op++) {
+        wanted = (int32_t)(next_random(&state) % size);
+        list_seek(&list, &wanted);
+      }
+      list_timing_stop(&timing);
+      list_timing_report(b, &timing, "seek", size, ops);
+    }
+
+    if (list_wanted(b, "hash", size)) {
+      ops = 1000000 / size > 0 ? 1000000 / size : 1;
+      list_timing_reset(&timing);
+      list_timing_start(&timing);
+      for (op = 0; op < ops; op++) {
+        list_hash(&list, &hash);
+      }
+      list_timing_stop(&timing);
+      list_timing_report(b, &timing, "hash", size, ops * size);
+    }
+
+    if (list_wanted(b, "dump", size) || list_wanted(b, "restore", size)) {
+      dump = tmpfile();
+      list_timing_reset(&timing);
+      list_timing_start(&timing);
+      list_dump_filedescriptor(&list, fileno(dump), &length);
+      list_timing_stop(&timing);
+      list_timing_report(b, &timing, "dump", size, size);
+
+      lseek(fileno(dump), 0, SEEK_SET);
+      list_init(&restored);
+      list_timing_reset(&timing);
+      list_timing_start(&timing);
+      list_restore_filedescriptor(&restored, fileno(dump), &length);
+      list_timing_stop(&timing);
+      list_timing_report(b, &timing, "restore", size, size);
+
+      // restored elements are copies the list does not own
+      list_iterator_start(&restored);
+      while (list_iterator_hasnext(&restored)) {
+        free(list_iterator_next(&restored));
+      }
+      list_iterator_stop(&restored);
+      list_destroy(&restored);
+      fclose(dump);
+    }
+
+    if (list_wanted(b, "delete_at", size)) {
+      ops = scaled_ops(size, 20000000);
+      ops = (ops > size / 2) ? ((size / 2) ? size / 2 : 1) : ops;
+      list_timing_reset(&timing);
+      list_timing_start(&timing);
+      for (op = 0; op < ops; op++) {
+        list_delete_at(&list, next_random(&state) % list_size(&list));
+      }
+      list_timing_stop(&timing);
+      list_timing_report(b, &timing, "delete_at", size, ops);
+    }
+    list_destroy(&list);
+
+    // sorting reorders the referenced values, so reshuffle before each run
+    if (list_wanted(b, sort_name, size)) {
+      ops = 100000 / size > 0 ? 100000 / size : 1;
+      fill_list(&list, values, size);
+      list_timing_reset(&timing);
+      for (op = 0; op < ops; op++) {
+        for (j = 0; j < size; j++) {
+          values[j] = (int32_t)next_random(&state);
+        }
+        list_timing_start(&timing);
+        list_sort(&list, 1);
+        list_timing_stop(&timing);
+      }
+      list_timing_report(b, &timing, sort_name, size, ops * size);
+      list_destroy(&list);
+    }
+
+    free(values);
+  }
+}
+
+// Run through each of the benchmark functions.
+void run_benches(struct bench_context *b) {
+  bench_ping_pong(b);
+  bench_idle_scaling(b);
+  bench_simclist(b);
+}
+
+// Two-sided 95% critical values of Student's t by degrees of freedom.
+double t_critical(double df) {
+  static const double table[] = {
+    12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+    2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+    2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+  };
+  int index = (int)floor(df);
+
+  if (index < 1) {
+    index = 1;
+  }
+  return index <= 30 ? table[index - 1] : 1.96;
+}
+
+double sample_mean(const double *samples, int n) {
+  double sum = 0.0;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    sum += samples[i];
+  }
+  return n ? sum / n : 0.0;
+}
+
+double sample_variance(const double *samples, int n) {
+  double mean = sample_mean(samples, n);
+  double sum = 0.0;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    sum += (samples[i] - mean) * (samples[i] - mean);
+  }
+  return n > 1 ? sum / (n - 1) : 0.0;
+}
+
+// Half width of the 95% confidence interval of the mean.
+double confidence(const double *samples, int n) {
+  return n > 1 ? t_critical(n - 1) * sqrt(sample_variance(samples, n) / n) : 0.0;
+}
+
+void write_samples(FILE *out, const char *key, const double *samples, int n) {
+  int i;
+
+  fprintf(out, "\"%s\": [", key);
+  for (i = 0; i < n; i++) {
+    fprintf(out, "%s%.3f", i ? ", " : "", samples[i]);
+  }
+  fprintf(out, "], \"%s_mean\": %.3f, \"%s_ci95\": %.3f", key, sample_mean(samples, n),
+          key, confidence(samples, n));
+}
+
+// Writes every series with the machine it ran on.
+int write_json(struct bench_context *b, const char *path) {
+  struct bench_series *series;
+  struct utsname host;
+  char date[32];
+  time_t now = time(NULL);
+  FILE *out;
+  int i, j;
+
+  if (!(out = fopen(path, "w"))) {
+    perror(path);
+    return -1;
+  }
+  uname(&host);
+  strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+  fprintf(out, "{\n  \"version\": 1,\n  \"environment\": {");
+  fprintf(out, "\"date\": \"%s\", \"host\": \"%s\", \"system\": \"%s\", \"release\": \"%s\", "
+          "\"machine\": \"%s\", \"cpus\": %ld, \"compiler\": \"%s\", \"quick\": %d, "
+          "\"large\": %d, \"repeats\": %d, \"counters\": \"%s\"},\n  \"results\": [\n",
+          date, host.nodename, host.sysname, host.release, host.machine,
+          sysconf(_SC_NPROCESSORS_ONLN), __VERSION__, b->quick, b->large, b->repeats,
+          !counters.enabled ? "none" : (counters.kernel ? "user+kernel" : "user"));
+  for (i = 0; i < b->series_count; i++) {
+    series = &b->series[i];
+    fprintf(out, "    {\"name\": \"%s\", \"samples\": %d, \"ops_per_sec\": %.1f, ",
+            series->name, series->samples, series->ops_per_sec);
+    if (series->allocs_per_op >= 0) {
+      fprintf(out, "\"allocs_per_op\": %.3f, ", series->allocs_per_op);
+    }
+    for (j = 0; series->has_counters && j < COUNTERS; j++) {
+      if (series->counters_per_op[j] >= 0) {
+        fprintf(out, "\"%s_per_op\": %.3f, ", counter_names[j], series->counters_per_op[j]);
+      }
+    }
+    write_samples(out, "ns_per_op", series->ns_per_op, series->samples);
+    if (series->has_latency) {
+      fprintf(out, ", ");
+      write_samples(out, "p99_ns", series->p99_ns, series->samples);
+    }
+    fprintf(out, "}%s\n", (i + 1 < b->series_count) ? "," : "");
+  }
+  fprintf(out, "  ]\n}\n");
+  fclose(out);
+
+  return 0;
+}
+
+// Reads the numbers following "key": [ into samples; returns how many.
+int read_samples(const char *text, const char *end, const char *key, double *samples) {
+  char pattern[64];
+  const char *cursor;
+  char *after;
+  int n = 0;
+
+  snprintf(pattern, sizeof(pattern), "\"%s\": [", key);
+  if (!(cursor = strstr(text, pattern)) || cursor > end) {
+    return 0;
+  }
+  cursor += strlen(pattern);
+  while (n < MAX_SAMPLES && *cursor != ']') {
+    samples[n++] = strtod(cursor, &after);
+    if (after == cursor) {
+      break;
+    }
+    cursor = after;
+    while (*cursor == ',' || *cursor == ' ') {
+      cursor++;
+    }
+  }
+  return n;
+}
+
+// Loads the series of a JSON file written by write_json.
+int read_json(const char *path, struct bench_series **series, int *count) {
+  struct bench_series *entry;
+  const char *cursor;
+  const char *end;
+  char name[64];
+  char *text;
+  long length;
+  int capacity = 0;
+  FILE *in;
+
+  if (!(in = fopen(path, "r"))) {
+    perror(path);
+    return -1;
+  }
+  fseek(in, 0, SEEK_END);
+  length = ftell(in);
+  fseek(in, 0, SEEK_SET);
+  text = calloc(length + 1, 1);
+  if (fread(text, 1, length, in) != (size_t)length) {
+    length = 0;
+  }
+  fclose(in);
+
+  // one result per line, so each record ends at the next newline
+  for (cursor = text; (cursor = strstr(cursor, "{\"name\": \"")); cursor = end) {
+    cursor += strlen("{\"name\": \"");
+    end = strchr(cursor, '\n');
+    end = end ? end : text + length;
+    if (sscanf(cursor, "%63[^\"]", name) != 1 ||
+        !(entry = find_series(series, count, &capacity, name))) {
+      continue;
+    }
+    entry->samples = read_samples(cursor, end, "ns_per_op", entry->ns_per_op);
+    entry->has_latency = read_samples(cursor, end, "p99_ns", entry->p99_ns) == entry->samples;
+  }
+  free(text);
+
+  return 0;
+}
+
+// Welch's t-test on one metric; returns 1 for a significant regression.
+// Lower is better for every metric compared.
+int compare_metric(struct bench_context *b, const char *name, const char *metric,
+                   const double *baseline, int baseline_n, const double *current, int current_n) {
+  double base_mean = sample_mean(baseline, baseline_n);
+  double mean = sample_mean(current, current_n);
+  double base_term = sample_variance(baseline, baseline_n) / baseline_n;
+  double term = sample_variance(current, current_n) / current_n;
+  double error = sqrt(base_term + term);
+  double difference = mean - base_mean;
+  double df, margin, change;
+  const char *verdict;
+  const char *color;
+  int regressed = 0;
+
+  if (baseline_n < 2 || current_n < 2 || base_mean <= 0) {
+    printf("%-38s %-9s needs at least two runs on each side\n", name, metric);
+    return 0;
+  }
+  df = (base_term + term) * (base_term + term) /
+       ((base_term * base_term) / (baseline_n - 1) + (term * term) / (current_n - 1) + 1e-300);
+  margin = t_critical(df) * error;
+  change = difference / base_mean;
+
+  if ((difference - margin > 0) && (change > b->threshold)) {
+    verdict = "REGRESSION";
+    color = COLOR_RED;
+    regressed = 1;
+  } else if ((difference + margin < 0) && (-change > b->threshold)) {
+    verdict = "improved";
+    color = COLOR_GREEN;
+  } else {
+    verdict = "same";
+    color = COLOR_OFF;
+  }
+  printf("%-38s %-9s %12.1f -> %12.1f  %+7.2f%% (95%% CI %+.1f .. %+.1f)  %s%s%s\n",
+         name, metric, base_mean, mean, change * 100.0, difference - margin, difference + margin,
+         color, verdict, COLOR_OFF);
+  return regressed;
+}
+
+// Checks this run against a stored baseline; returns the regression count.
+int compare_baseline(struct bench_context *b, const char *path) {
+  struct bench_series *baseline = NULL;
+  struct bench_series *current;
+  int baseline_count = 0;
+  int regressions = 0;
+  int i, j;
+
+  if (read_json(path, &baseline, &baseline_count)) {
+    return -1;
+  }
+  printf("%sComparing with %s (threshold %.1f%%)...%s\n", COLOR_YELLOW, path,
+         b->threshold * 100.0, COLOR_OFF);
+  for (i = 0; i < b->series_count; i++) {
+    current = &b->series[i];
+    for (j = 0; j < baseline_count && strcmp(baseline[j].name, current->name); j++) {
+    }
+    if (j == baseline_count) {
+      printf("%-38s not in the baseline\n", current->name);
+      continue;
+    }
+    regressions += compare_metric(b, current->name, "ns/op", baseline[j].ns_per_op,
+                                  baseline[j].samples, current->ns_per_op, current->samples);
+    if (current->has_latency && baseline[j].has_latency) {
+      regressions += compare_metric(b, current->name, "p99 ns", baseline[j].p99_ns,
+                                    baseline[j].samples, current->p99_ns, current->samples);
+    }
+  }
+  free(baseline);
+
+  return regressions;
+}
+
+// Mean and confidence interval of every case run more than once.
+void print_summary(struct bench_context *b) {
+  struct bench_series *series;
+  int i;
+
+  printf("%sSummary over %d runs (mean +- 95%% CI)...%s\n", COLOR_YELLOW, b->repeats, COLOR_OFF);
+  for (i = 0; i < b->series_count; i++) {
+    series = &b->series[i];
+    printf("%s%-38s%s %12.1f +- %9.1f ns/op", COLOR_BLUE, series->name, COLOR_OFF,
+           sample_mean(series->ns_per_op, series->samples),
+           confidence(series->ns_per_op, series->samples));
+    if (series->has_latency) {
+      printf("  p99 %12.1f +- %9.1f ns", sample_mean(series->p99_ns, series->samples),
+             confidence(series->p99_ns, series->samples));
+    }
+    printf("\n");
+  }
+}
+
+void usage(const char *program) {
+  fprintf(stderr,
+          "usage: %s [-q] [-l] [-p] [-r runs] [-j results.json] [-c baseline.json] [-t percent] [filter]\n"
+          "  -q  short runs\n"
+          "  -l  add the 10M-element simclist cases\n"
+          "  -p  read cycles, instructions, cache and branch misses per operation\n"
+          "  -r  run the suite this many times (default 1, or 5 with -c)\n"
+          "  -j  write the results as JSON\n"
+          "  -c  compare with a baseline written by -j; exits 1 on a regression\n"
+          "  -t  smallest change worth flagging, in percent (default 5)\n",
+          program);
+}
+
+int main(int argc, char **argv) {
+  struct bench_context context = { .filter = NULL, .quick = 0, .large = 0, .ran = 0, .repeats = 0,
+                                   .threshold = 0.05 };
+  const char *json_path = NULL;
+  const char *baseline_path = NULL;
+  int counters_wanted = 0;
+  int regressions = 0;
+  int run;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-q")) {
+      context.quick = 1;
+    } else if (!strcmp(argv[i], "-l")) {
+      context.large = 1;
+    } else if (!strcmp(argv[i], "-p")) {
+      counters_wanted = 1;
+    } else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+      context.repeats = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+      json_path = argv[++i];
+    } else if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+      baseline_path = argv[++i];
+    } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+      context.threshold = atof(argv[++i]) / 100.0;
+    } else if (argv[i][0] == '-') {
+      usage(argv[0]);
+      return 2;
+    } else {
+      context.filter = argv[i];
+    }
+  }
+  if (context.repeats <= 0) {
+    context.repeats = baseline_path ? 5 : 1;
+  }
+  context.repeats = context.repeats > MAX_SAMPLES ? MAX_SAMPLES : context.repeats;
+
+  printf("%sBenchmarking pcomm...%s\n", COLOR_YELLOW, COLOR_OFF);
+  if (counters_wanted) {
+    counters_open();
+  }
+  for (run = 0; run < context.repeats; run++) {
+    run_benches(&context);
+  }
+  if (!context.ran) {
+    printf("%sNo benchmarks matched.%s\n", COLOR_YELLOW, COLOR_OFF);
+  }
+  if (context.repeats > 1) {
+    print_summary(&context);
+  }
+  if (json_path && write_json(&context, json_path)) {
+    return 2;
+  }
+  if (baseline_path && (regressions = compare_baseline(&context, baseline_path)) < 0) {
+    return 2;
+  }
+  free(context.series);
+
+  return regressions ? 1 : 0;
+}
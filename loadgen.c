@@ -0,0 +1,491 @@
+/*
+ *  PComm open-loop load generator
+ *
+ *  Sends fixed-size requests round-robin over many socketpairs at a fixed
+ *  rate, whether or not earlier requests have been answered, to an echo
+ *  loop on its own thread. Each request has an intended send time on the
+ *  schedule, and latency is measured from that time rather than from when
+ *  the request actually went out, so stalls in either loop show up as the
+ *  queueing delay every request behind them would see (no coordinated
+ *  omission). Latency from when the request's last byte was written is
+ *  reported next to it.
+ *
+ *      loadgen [-c connections] [-r rate[,rate...]] [-d seconds] [-s size]
+ *              [-w service_us] [-H]
+ */
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "pcomm.h"
+
+#define MICROSECOND    (int64_t)1000LL
+#define MILLISECOND (int64_t)1000000LL
+#define SECOND   (int64_t)1000000000LL
+
+#define MAX_RATES 16
+#define MIN_TICK (100 * MICROSECOND)  // finest send batch, coarser schedules tick per request
+#define DRAIN_MS 2000                 // wait for answers after the last send
+
+// descriptors that select can watch, two per connection, less some spare
+#define MAX_CONNECTIONS ((FD_SETSIZE - 32) / 2)
+
+// A latency histogram with what the HDR summary needs besides the buckets.
+struct latency {
+  pcomm_histogram_t histogram;
+  double sum_squares;
+};
+
+// When one request was due and when its last byte was written, 0 until then.
+struct request {
+  int64_t intended;
+  int64_t sent;
+};
+
+// Requests sent on one connection and not yet answered, oldest first. A
+// stream echoes in order, so each whole answer belongs to the oldest.
+struct connection {
+  int client;
+  int server;
+  struct request *queue;
+  size_t capacity;        // a power of two
+  size_t head;
+  size_t count;
+  size_t unwritten;       // requests at the back of the queue not yet fully written
+  size_t flushed;         // bytes of the first unwritten request already written
+  uint64_t bytes_out;     // written since pcomm last took the write descriptor
+  size_t received;        // bytes of the next answer seen so far
+  size_t served;          // server: bytes of the next request seen so far
+};
+
+struct load {
+  // options
+  int connections;
+  uint64_t rate;          // requests per second
+  int64_t duration_ns;
+  size_t size;
+  int64_t service_ns;     // busy work per request in the echo loop
+
+  struct connection *links;
+  struct connection **by_fd;
+  int max_fd;
+  uint8_t *message;
+
+  pcomm_context_t client;
+  pcomm_context_t server;
+  int64_t started;
+  int64_t interval_ns;
+  uint64_t planned;       // requests on the schedule
+  uint64_t sent;
+  uint64_t completed;
+  uint64_t timed_out;
+  uint64_t late_ticks;    // timer expirations the client loop missed
+  int draining;
+
+  struct latency intended;
+  struct latency actual;
+};
+
+int64_t get_nano_timestamp(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * SECOND + (int64_t)ts.tv_nsec;
+}
+
+const char *format_nanos(char *buffer, size_t size, uint64_t ns) {
+  if (ns < 10 * MICROSECOND) {
+    snprintf(buffer, size, "%" PRIu64 "ns", ns);
+  } else if (ns < 10 * MILLISECOND) {
+    snprintf(buffer, size, "%.1fus", ns / 1000.0);
+  } else if (ns < 10 * SECOND) {
+    snprintf(buffer, size, "%.1fms", ns / 1000000.0);
+  } else {
+    snprintf(buffer, size, "%.1fs", ns / 1000000000.0);
+  }
+  return buffer;
+}
+
+void latency_record(struct latency *l, int64_t ns) {
+  if (ns < 0) {
+    ns = 0;
+  }
+  pcomm_histogram_record(&l->histogram, (uint64_t)ns);
+  l->sum_squares += (double)ns * (double)ns;
+}
+
+void queue_push(struct connection *link, int64_t intended) {
+  struct request *grown;
+  size_t i;
+
+  if (link->count == link->capacity) {
+    grown = malloc(sizeof(*grown) * link->capacity * 2);
+    for (i = 0; i < link->count; i++) {
+      grown[i] = link->queue[(link->head + i) & (link->capacity - 1)];
+    }
+    free(link->queue);
+    link->queue = grown;
+    link->capacity *= 2;
+    link->head = 0;
+  }
+  link->queue[(link->head + link->count) & (link->capacity - 1)] = (struct request){ intended, 0 };
+  link->count++;
+  link->unwritten++;
+}
+
+struct request queue_pop(struct connection *link) {
+  struct request oldest = link->queue[link->head];
+
+  link->head = (link->head + 1) & (link->capacity - 1);
+  link->count--;
+  return oldest;
+}
+
+void finish(struct load *load) {
+  pcomm_stop(&load->client, 1);
+}
+
+void on_request(pcomm_context_t *context, int fd, uint8_t *data, size_t length) {
+  struct load *load = (struct load *)pcomm_get_external_context(context);
+  struct connection *link = load->by_fd[fd];
+  int64_t until;
+
+  link->served += length;
+  while (link->served >= load->size) {
+    link->served -= load->size;
+    if (load->service_ns) {
+      until = get_nano_timestamp() + load->service_ns;
+      while (get_nano_timestamp() < until) {
+      }
+    }
+    pcomm_add_write_fd(context, fd, load->message, load->size, NULL, NULL);
+  }
+}
+
+void on_answer(pcomm_context_t *context, int fd, uint8_t *data, size_t length) {
+  struct load *load = (struct load *)pcomm_get_external_context(context);
+  struct connection *link = load->by_fd[fd];
+  struct request request;
+  int64_t now;
+
+  link->received += length;
+  if (link->received < load->size) {
+    return;
+  }
+  now = get_nano_timestamp();
+  while (link->received >= load->size && link->count) {
+    link->received -= load->size;
+    request = queue_pop(link);
+    latency_record(&load->intended, now - request.intended);
+    latency_record(&load->actual, now - request.sent);
+    load->completed++;
+  }
+  if (load->draining && load->completed == load->sent) {
+    finish(load);
+  }
+}
+
+// Anything still unanswered is at least this late; count it so an overload
+// that never drains cannot look better than one that does.
+void on_drain_expired(pcomm_context_t *context, pcomm_timer_t *timer, void *arg) {
+  struct load *load = (struct load *)arg;
+  struct request request;
+  int64_t now = get_nano_timestamp();
+  int i;
+
+  for (i = 0; i < load->connections; i++) {
+    while (load->links[i].count) {
+      request = queue_pop(&load->links[i]);
+      latency_record(&load->intended, now - request.intended);
+      if (request.sent) {
+        latency_record(&load->actual, now - request.sent);
+      }
+      load->timed_out++;
+    }
+  }
+  finish(load);
+}
+
+// Called after each write on a client descriptor; stamps the requests it
+// finished. pcomm drops the write descriptor once its queue is empty, and
+// its byte count starts again with the next request.
+void on_written(pcomm_context_t *context, int fd, uint8_t *data, size_t length) {
+  struct load *load = (struct load *)pcomm_get_external_context(context);
+  struct connection *link = load->by_fd[fd];
+  pcomm_fd_stats_t stats;
+  int64_t now;
+
+  if (pcomm_get_fd_stats(context, PCOMM_STREAM_WRITE, fd, &stats) != PCOMM_SUCCESS) {
+    return;
+  }
+  now = get_nano_timestamp();
+  link->flushed += stats.bytes_out - link->bytes_out;
+  link->bytes_out = stats.bytes_out;
+  while (link->unwritten && link->flushed >= load->size) {
+    link->flushed -= load->size;
+    link->queue[(link->head + link->count - link->unwritten) & (link->capacity - 1)].sent = now;
+    link->unwritten--;
+  }
+  if (!link->unwritten) {
+    link->bytes_out = 0;
+  }
+}
+
+// Sends every request whose time has come. A late tick catches up on the
+// whole backlog at once; the requests still carry their scheduled times.
+void on_tick(pcomm_context_t *context, int fd, uint64_t expirations) {
+  struct load *load = (struct load *)pcomm_get_external_context(context);
+  struct connection *link;
+  int64_t now = get_nano_timestamp();
+  int64_t intended;
+
+  if (load->draining) {
+    return;
+  }
+  load->late_ticks += expirations - 1;
+  while (load->sent < load->planned) {
+    intended = load->started + (int64_t)load->sent * load->interval_ns;
+    if (intended > now) {
+      break;
+    }
+    link = &load->links[load->sent % load->connections];
+    queue_push(link, intended);
+    pcomm_add_write_fd(context, link->client, load->message, load->size, on_written, NULL);
+    load->sent++;
+  }
+  if (load->sent == load->planned) {
+    load->draining = 1;
+    if (load->completed == load->sent) {
+      finish(load);
+    } else {
+      pcomm_timer_add(context, DRAIN_MS, 0, on_drain_expired, load, NULL);
+    }
+  }
+}
+
+void *run_server(void *arg) {
+  struct load *load = (struct load *)arg;
+
+  pcomm_main(&load->server);
+  return NULL;
+}
+
+int setup(struct load *load) {
+  int pair[2];
+  int i;
+
+  load->links = calloc(load->connections, sizeof(*load->links));
+  load->message = calloc(load->size, 1);
+  load->max_fd = 0;
+  for (i = 0; i < load->connections; i++) {
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0) {
+      perror("socketpair");
+      return -1;
+    }
+    load->links[i].client = pair[0];
+    load->links[i].server = pair[1];
+    load->links[i].capacity = 64;
+    load->links[i].queue = malloc(sizeof(struct request) * load->links[i].capacity);
+    load->max_fd = pair[1] > load->max_fd ? pair[1] : load->max_fd;
+    load->max_fd = pair[0] > load->max_fd ? pair[0] : load->max_fd;
+  }
+  load->by_fd = calloc(load->max_fd + 1, sizeof(*load->by_fd));
+  for (i = 0; i < load->connections; i++) {
+    load->by_fd[load->links[i].client] = &load->links[i];
+    load->by_fd[load->links[i].server] = &load->links[i];
+  }
+
+  pcomm_init(&load->client);
+  pcomm_init(&load->server);
+  pcomm_set_external_context(&load->client, load);
+  pcomm_set_external_context(&load->server, load);
+  pcomm_set_blocking(&load->client, 1);
+  pcomm_set_blocking(&load->server, 1);
+  for (i = 0; i < load->connections; i++) {
+    pcomm_add_read_fd(&load->client, load->links[i].client, on_answer, NULL);
+    pcomm_add_read_fd(&load->server, load->links[i].server, on_request, NULL);
+  }
+  return 0;
+}
+
+void teardown(struct load *load) {
+  int i;
+
+  pcomm_destroy(&load->client);
+  pcomm_destroy(&load->server);
+  for (i = 0; i < load->connections; i++) {
+    close(load->links[i].client);
+    close(load->links[i].server);
+    free(load->links[i].queue);
+  }
+  free(load->links);
+  free(load->by_fd);
+  free(load->message);
+}
+
+void print_summary(const char *label, struct latency *l) {
+  char p50[16], p90[16], p99[16], p999[16], p9999[16], max[16];
+  const pcomm_histogram_t *h = &l->histogram;
+
+  printf("  %-13s p50 %s  p90 %s  p99 %s  p99.9 %s  p99.99 %s  max %s\n", label,
+         format_nanos(p50, sizeof(p50), pcomm_histogram_percentile(h, 50.0)),
+         format_nanos(p90, sizeof(p90), pcomm_histogram_percentile(h, 90.0)),
+         format_nanos(p99, sizeof(p99), pcomm_histogram_percentile(h, 99.0)),
+         format_nanos(p999, sizeof(p999), pcomm_histogram_percentile(h, 99.9)),
+         format_nanos(p9999, sizeof(p9999), pcomm_histogram_percentile(h, 99.99)),
+         format_nanos(max, sizeof(max), h->max));
+}
+
+// The percentile spectrum in HdrHistogram's text (.hgrm) layout, values in
+// milliseconds: five steps in each half of the remaining distance to 100%.
+void print_spectrum(struct latency *l) {
+  const pcomm_histogram_t *h = &l->histogram;
+  const int ticks = 5;
+  double percentile;
+  double mean = 0.0;
+  double deviation = 0.0;
+  uint64_t value;
+  uint64_t rank;
+  int half;
+  int tick;
+
+  printf("%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+  for (half = 0; half < 40; half++) {
+    for (tick = 0; tick < ticks; tick++) {
+      percentile = 100.0 - 100.0 / pow(2.0, half) * (1.0 - tick / (2.0 * ticks));
+      value = pcomm_histogram_percentile(h, percentile);
+      rank = (uint64_t)((percentile / 100.0) * (double)h->count + 0.5);
+      rank = rank < 1 ? 1 : rank;
+      if (value >= h->max || rank >= h->count) {
+        half = 40;
+        break;
+      }
+      printf("%12.3f %14.12f %10" PRIu64 " %14.2f\n", value / 1e6, percentile / 100.0, rank,
+             1.0 / (1.0 - percentile / 100.0));
+    }
+  }
+  printf("%12.3f %14.12f %10" PRIu64 "\n", h->max / 1e6, 1.0, h->count);
+
+  if (h->count) {
+    mean = (double)h->sum / h->count;
+    deviation = sqrt(fmax(l->sum_squares / h->count - mean * mean, 0.0));
+  }
+  printf("#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean / 1e6, deviation / 1e6);
+  printf("#[Max     = %12.3f, Total count    = %12" PRIu64 "]\n", h->max / 1e6, h->count);
+  printf("#[Buckets = %12d, SubBuckets     = %12d]\n", PCOMM_HIST_BUCKETS, PCOMM_HIST_SUB_BUCKETS);
+}
+
+int run_load(struct load *load, int spectrum) {
+  struct timespec tick = { 0, 0 };
+  int64_t tick_ns;
+  int64_t elapsed;
+  pthread_t thread;
+  int timer_fd;
+
+  if (setup(load) < 0) {
+    return -1;
+  }
+  load->interval_ns = SECOND / (int64_t)load->rate;
+  load->interval_ns = load->interval_ns ? load->interval_ns : 1;
+  load->planned = (uint64_t)(load->duration_ns / load->interval_ns);
+  tick_ns = load->interval_ns > MIN_TICK ? load->interval_ns : MIN_TICK;
+  tick.tv_sec = tick_ns / SECOND;
+  tick.tv_nsec = tick_ns % SECOND;
+
+  pthread_create(&thread, NULL, run_server, load);
+  load->started = get_nano_timestamp();
+  pcomm_add_timer_fd(&load->client, &tick, &tick, on_tick, &timer_fd);
+  pcomm_main(&load->client);
+  elapsed = get_nano_timestamp() - load->started;
+  pcomm_stop(&load->server, 1);
+  pthread_join(thread, NULL);
+
+  printf("rate %" PRIu64 "/s over %d connections: sent %" PRIu64 ", answered %" PRIu64
+         ", unanswered %" PRIu64 ", achieved %.0f/s",
+         load->rate, load->connections, load->sent, load->completed, load->timed_out,
+         load->completed * (double)SECOND / elapsed);
+  if (load->late_ticks) {
+    printf(", %" PRIu64 " late ticks", load->late_ticks);
+  }
+  printf("\n");
+  print_summary("from intended", &load->intended);
+  print_summary("from written", &load->actual);
+  if (spectrum) {
+    printf("\n");
+    print_spectrum(&load->intended);
+    printf("\n");
+  }
+
+  teardown(load);
+  return 0;
+}
+
+void usage(const char *program) {
+  fprintf(stderr,
+          "usage: %s [-c connections] [-r rate[,rate...]] [-d seconds] [-s size] [-w service_us] [-H]\n"
+          "  -c  socketpairs to spread requests over (default 32, at most %d)\n"
+          "  -r  requests per second; a list runs each rate in turn (default 10000)\n"
+          "  -d  seconds of load per rate (default 5)\n"
+          "  -s  request and answer size in bytes (default 64)\n"
+          "  -w  busy work per request in the echo loop, in microseconds (default 0)\n"
+          "  -H  print the full percentile spectrum, latency from intended send time\n",
+          program, MAX_CONNECTIONS);
+}
+
+int main(int argc, char **argv) {
+  struct load options = { .connections = 32, .duration_ns = 5 * SECOND, .size = 64,
+                          .service_ns = 0 };
+  struct load load;
+  uint64_t rates[MAX_RATES] = { 10000 };
+  int rate_count = 1;
+  int spectrum = 0;
+  char *rate;
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+      options.connections = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+      rate_count = 0;
+      for (rate = strtok(argv[++i], ","); rate && rate_count < MAX_RATES; rate = strtok(NULL, ",")) {
+        rates[rate_count++] = strtoull(rate, NULL, 10);
+      }
+    } else if (!strcmp(argv[i], "-d") && i + 1 < argc) {
+      options.duration_ns = (int64_t)(atof(argv[++i]) * SECOND);
+    } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+      options.size = (size_t)atol(argv[++i]);
+    } else if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+      options.service_ns = (int64_t)(atof(argv[++i]) * MICROSECOND);
+    } else if (!strcmp(argv[i], "-H")) {
+      spectrum = 1;
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (options.connections < 1 || options.connections > MAX_CONNECTIONS || !options.size ||
+      options.duration_ns <= 0 || !rate_count) {
+    usage(argv[0]);
+    return 2;
+  }
+  for (i = 0; i < rate_count; i++) {
+    if (!rates[i]) {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+
+  for (i = 0; i < rate_count; i++) {
+    load = options;
+    load.rate = rates[i];
+    if (run_load(&load, spectrum) < 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
@@ -16,6 +16,7 @@
  *
  */
 #include "pcomm.h"
+#include "pcomm_probes.h"
 
 int _list_aid_seeker( const void *element, const void *indicator )
 {
@@ -38,6 +39,374 @@ int _list_aid_comparator( const void *a, const void *b )
     return 0;
 }
 
+/* Timer states, stored in pcomm_timer_t.level when not linked into a slot */
+#define PCOMM_TIMER_UNLINKED  -1
+#define PCOMM_TIMER_PENDING   -2
+#define PCOMM_TIMER_IDLE      -3
+
+uint64_t _pcomm_clock_ns( void )
+{
+    struct timespec now;
+
+    clock_gettime( CLOCK_MONOTONIC, &now );
+    return ((uint64_t)now.tv_sec * 1000000000ULL) + (uint64_t)now.tv_nsec;
+}
+
+/* sample the monotonic clock into the context */
+void _pcomm_update_clock( pcomm_context_t *context )
+{
+    struct timespec now;
+
+    clock_gettime( context->coarse_clock ? CLOCK_MONOTONIC_COARSE : CLOCK_MONOTONIC, &now );
+    context->now_ns = ((uint64_t)now.tv_sec * 1000000000ULL) + (uint64_t)now.tv_nsec;
+}
+
+/* The loop samples the clock once per iteration and everything it runs
+ * shares that reading; outside the loop the clock is read on demand.
+ */
+uint64_t _pcomm_now_ns( pcomm_context_t *context )
+{
+    if ( !context->looping ) {
+        _pcomm_update_clock( context );
+    }
+    return context->now_ns;
+}
+
+uint64_t _pcomm_now_ms( pcomm_context_t *context )
+{
+    return _pcomm_now_ns( context ) / 1000000ULL;
+}
+
+/* Histogram timing: a start stamp (0 while histograms are off) and a stop
+ * that records the elapsed time. Durations use the precise clock even in
+ * coarse mode.
+ */
+uint64_t _pcomm_hist_start( pcomm_context_t *context )
+{
+    return context->histograms ? _pcomm_clock_ns() : 0;
+}
+
+uint64_t _pcomm_hist_stop( pcomm_context_t *context, pcomm_hist_t which, uint64_t start )
+{
+    uint64_t elapsed = 0;
+
+    if ( context->histograms && start ) {
+        elapsed = _pcomm_clock_ns() - start;
+        pcomm_histogram_record( &context->histograms[which], elapsed );
+    }
+    return elapsed;
+}
+
+/* Append one record to the trace ring. Only the loop thread writes, so the
+ * slot needs no claim; publishing head with release lets pcomm_trace_dump
+ * on another thread see the record complete.
+ */
+void _pcomm_trace( pcomm_context_t *context, pcomm_trace_event_t event, int fd, int64_t value )
+{
+    struct PCOMM_TRACE *trace = &context->trace;
+    pcomm_trace_record_t *record;
+    uint64_t head;
+
+    if ( trace->records ) {
+        head = trace->head;
+        record = &trace->records[head & trace->mask];
+        record->ns = _pcomm_clock_ns();
+        record->value = value;
+        record->fd = fd;
+        record->event = (uint32_t)event;
+        __atomic_store_n( &trace->head, head + 1, __ATOMIC_RELEASE );
+    }
+}
+
+/* Callback bracketing: time it for the histograms and tell the watchdog
+ * and the trace what is running
+ */
+uint64_t _pcomm_enter( pcomm_context_t *context, pcomm_hist_t which, int fd )
+{
+    if ( context->watchdog.running ) {
+        __atomic_store_n( &context->watchdog.running_fd, fd, __ATOMIC_RELAXED );
+        __atomic_store_n( &context->watchdog.running_kind, (int)which, __ATOMIC_RELAXED );
+    }
+    _pcomm_trace( context, PCOMM_TRACE_CALLBACK, fd, (int64_t)which );
+    PCOMM_PROBE3( callback__entry, context, (int)which, fd );
+    return _pcomm_hist_start( context );
+}
+
+uint64_t _pcomm_leave( pcomm_context_t *context, pcomm_hist_t which, uint64_t start )
+{
+    uint64_t elapsed = _pcomm_hist_stop( context, which, start );
+
+    PCOMM_PROBE3( callback__return, context, (int)which, elapsed );
+    if ( context->watchdog.running ) {
+        __atomic_store_n( &context->watchdog.running_kind, (int)PCOMM_HIST_ITERATION, __ATOMIC_RELAXED );
+        __atomic_store_n( &context->watchdog.running_fd, -1, __ATOMIC_RELAXED );
+    }
+    return elapsed;
+}
+
+/* tick at which a timer set now for timeout_ms expires, rounded up so that
+ * timers never fire early
+ */
+uint64_t _pcomm_timer_deadline( pcomm_context_t *context, uint64_t timeout_ms )
+{
+    return ((_pcomm_now_ns( context ) + 999999ULL) / 1000000ULL) + timeout_ms;
+}
+
+void _pcomm_timer_push( pcomm_timer_t **head, pcomm_timer_t *timer )
+{
+    timer->prev = NULL;
+    timer->next = *head;
+    if ( *head ) {
+        (*head)->prev = timer;
+    }
+    *head = timer;
+}
+
+void _pcomm_timer_pull( pcomm_timer_t **head, pcomm_timer_t *timer )
+{
+    if ( timer->prev ) {
+        timer->prev->next = timer->next;
+    } else {
+        *head = timer->next;
+    }
+    if ( timer->next ) {
+        timer->next->prev = timer->prev;
+    }
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+/* remove a timer from whichever wheel list currently holds it */
+void _pcomm_timer_unlink( struct PCOMM_WHEEL *wheel, pcomm_timer_t *timer )
+{
+    if ( timer->level >= 0 ) {
+        _pcomm_timer_pull( &wheel->slots[timer->level][timer->slot], timer );
+        if ( !wheel->slots[timer->level][timer->slot] ) {
+            wheel->occupied[timer->level][timer->slot >> 6] &= ~(1ULL << (timer->slot & 63));
+        }
+        wheel->count--;
+    } else if ( timer->level == PCOMM_TIMER_PENDING ) {
+        _pcomm_timer_pull( &wheel->pending, timer );
+    } else if ( timer->level == PCOMM_TIMER_IDLE ) {
+        _pcomm_timer_pull( &wheel->idle, timer );
+    }
+    timer->level = PCOMM_TIMER_UNLINKED;
+    // tell the dispatcher not to touch a timer released by its own callback
+    if ( timer == wheel->running ) {
+        wheel->running = NULL;
+    }
+}
+
+/* place a timer in the slot matching its expiry, relative to the current tick */
+void _pcomm_timer_link( struct PCOMM_WHEEL *wheel, pcomm_timer_t *timer )
+{
+    uint64_t delta;
+    uint64_t placement;
+    int level = 0;
+
+    if ( timer->expires < wheel->current ) {
+        timer->expires = wheel->current;
+    }
+    delta = timer->expires - wheel->current;
+    placement = timer->expires;
+
+    // Timers beyond the reach of the top level are parked in its furthest
+    // slot and re-filed each time that slot is cascaded.
+    if ( delta >> (PCOMM_WHEEL_BITS * PCOMM_WHEEL_LEVELS) ) {
+        delta = (1ULL << (PCOMM_WHEEL_BITS * PCOMM_WHEEL_LEVELS)) - 1;
+        placement = wheel->current + delta;
+    }
+    while ( (level < (PCOMM_WHEEL_LEVELS - 1)) &&
+            (delta >> (PCOMM_WHEEL_BITS * (level + 1))) ) {
+        level++;
+    }
+
+    timer->level = level;
+    timer->slot = (int)((placement >> (PCOMM_WHEEL_BITS * level)) & PCOMM_WHEEL_MASK);
+    _pcomm_timer_push( &wheel->slots[level][timer->slot], timer );
+    wheel->occupied[level][timer->slot >> 6] |= 1ULL << (timer->slot & 63);
+    wheel->count++;
+}
+
+/* distance from slot 'from' to the next occupied slot of a level, or -1 */
+int _pcomm_wheel_scan( const uint64_t *occupied, unsigned int from )
+{
+    unsigned int word = (from >> 6) % PCOMM_WHEEL_WORDS;
+    uint64_t bits = occupied[word] & (~0ULL << (from & 63));
+    unsigned int i;
+
+    for ( i = 0; i <= PCOMM_WHEEL_WORDS; i++ ) {
+        if ( bits ) {
+            return (int)(((word << 6) + __builtin_ctzll(bits) - from) & PCOMM_WHEEL_MASK);
+        }
+        word = (word + 1) % PCOMM_WHEEL_WORDS;
+        bits = occupied[word];
+    }
+    return -1;
+}
+
+/* Earliest tick at which the wheel has work: the exact expiry for level 0,
+ * and the cascade tick for the higher levels. Returns 0 if the wheel is
+ * empty (tick 0 is never in the future).
+ */
+uint64_t _pcomm_wheel_next( struct PCOMM_WHEEL *wheel )
+{
+    uint64_t next = 0;
+    uint64_t start;
+    uint64_t tick;
+    int shift;
+    int level;
+    int distance;
+
+    if ( !wheel->count ) {
+        return 0;
+    }
+
+    distance = _pcomm_wheel_scan( wheel->occupied[0], wheel->current & PCOMM_WHEEL_MASK );
+    if ( distance >= 0 ) {
+        next = wheel->current + distance;
+    }
+    for ( level = 1; level < PCOMM_WHEEL_LEVELS; level++ ) {
+        shift = PCOMM_WHEEL_BITS * level;
+        start = wheel->current >> shift;
+        // A slot is cascaded on the first tick of its span, so the slot
+        // under the cursor is still due only if we are sitting on that tick.
+        if ( wheel->current & ((1ULL << shift) - 1) ) {
+            start++;
+        }
+        distance = _pcomm_wheel_scan( wheel->occupied[level], start & PCOMM_WHEEL_MASK );
+        if ( distance >= 0 ) {
+            tick = (start + distance) << shift;
+            if ( !next || (tick < next) ) {
+                next = tick;
+            }
+        }
+    }
+
+    return next;
+}
+
+/* re-file every timer in a higher level slot against the current tick */
+void _pcomm_wheel_cascade( struct PCOMM_WHEEL *wheel, int level, int slot )
+{
+    pcomm_timer_t *timer;
+
+    while ( (timer = wheel->slots[level][slot]) ) {
+        _pcomm_timer_unlink( wheel, timer );
+        _pcomm_timer_link( wheel, timer );
+    }
+}
+
+/* milliseconds until the next timer needs attention, or -1 if none */
+int64_t _pcomm_timers_wait_ms( pcomm_context_t *context )
+{
+    uint64_t next;
+    uint64_t now;
+
+    if ( context->timers.pending ) {
+        return 0;
+    }
+    if ( !(next = _pcomm_wheel_next( &context->timers )) ) {
+        return -1;
+    }
+    now = _pcomm_now_ms( context );
+    return (next > now) ? (int64_t)(next - now) : 0;
+}
+
+/* Advance the wheel to the present and run the callbacks of every timer that
+ * has expired. Ticks with nothing to do are skipped rather than walked.
+ */
+void _pcomm_timers_run( pcomm_context_t *context )
+{
+    struct PCOMM_WHEEL *wheel = &context->timers;
+    pcomm_timer_t *timer;
+    uint64_t now = _pcomm_now_ms( context );
+    uint64_t tick;
+    uint64_t next;
+    uint64_t start;
+    int level;
+    int slot;
+
+    while ( wheel->current <= now ) {
+        if ( !(next = _pcomm_wheel_next( wheel )) ) {
+            wheel->current = now + 1;
+            break;
+        }
+        if ( next > wheel->current ) {
+            wheel->current = (next > now) ? (now + 1) : next;
+            continue;
+        }
+
+        tick = wheel->current;
+        for ( level = PCOMM_WHEEL_LEVELS - 1; level > 0; level-- ) {
+            if ( !(tick & ((1ULL << (PCOMM_WHEEL_BITS * level)) - 1)) ) {
+                _pcomm_wheel_cascade( wheel, level,
+                    (int)((tick >> (PCOMM_WHEEL_BITS * level)) & PCOMM_WHEEL_MASK) );
+            }
+        }
+
+        slot = (int)(tick & PCOMM_WHEEL_MASK);
+        while ( (timer = wheel->slots[0][slot]) ) {
+            _pcomm_timer_unlink( wheel, timer );
+            _pcomm_timer_push( &wheel->pending, timer );
+            timer->level = PCOMM_TIMER_PENDING;
+        }
+        wheel->current = tick + 1;
+    }
+
+    while ( (timer = wheel->pending) && !context->exit_now ) {
+        _pcomm_timer_unlink( wheel, timer );
+        wheel->running = timer;
+        if ( timer->callback ) {
+            context->stats.timers_fired++;
+            start = _pcomm_enter( context, PCOMM_HIST_TIMER, -1 );
+            timer->callback( context, timer, timer->arg );
+            _pcomm_leave( context, PCOMM_HIST_TIMER, start );
+        }
+        // the callback released the timer (or the descriptor embedding it)
+        if ( wheel->running != timer ) {
+            continue;
+        }
+        wheel->running = NULL;
+
+        if ( timer->level != PCOMM_TIMER_UNLINKED ) {
+            // the callback re-armed the timer itself
+        } else if ( timer->interval ) {
+            timer->expires += timer->interval;
+            _pcomm_timer_link( wheel, timer );
+        } else if ( timer->detached ) {
+            free( timer );
+        } else {
+            _pcomm_timer_push( &wheel->idle, timer );
+            timer->level = PCOMM_TIMER_IDLE;
+        }
+    }
+}
+
+void _pcomm_timers_free( struct PCOMM_WHEEL *wheel )
+{
+    pcomm_timer_t *timer;
+    int level;
+    int slot;
+
+    for ( level = 0; level < PCOMM_WHEEL_LEVELS; level++ ) {
+        for ( slot = 0; slot < PCOMM_WHEEL_SLOTS; slot++ ) {
+            while ( (timer = wheel->slots[level][slot]) ) {
+                _pcomm_timer_unlink( wheel, timer );
+                free( timer );
+            }
+        }
+    }
+    while ( (timer = wheel->pending) ) {
+        _pcomm_timer_unlink( wheel, timer );
+        free( timer );
+    }
+    while ( (timer = wheel->idle) ) {
+        _pcomm_timer_unlink( wheel, timer );
+        free( timer );
+    }
+}
+
 pcomm_result_t _pcomm_make_fd_list( list_t *list, int **fd_list, size_t *length ) {
     pcomm_result_t result = PCOMM_SUCCESS;
     pcomm_fd_t *fd_context = NULL;
@@ -103,6 +472,8 @@ pcomm_result_t _pcomm_add_input_fd( list_t *list, int fd, int check_only,
         fd_context->offset   = 0;
         fd_context->last_read_empty = 0;
         fd_context->check_only = check_only;
+        fd_context->idle_timer.level = PCOMM_TIMER_UNLINKED;
+        fd_context->deadline_timer.level = PCOMM_TIMER_UNLINKED;
 
         list_append( list, fd_context );
     }
@@ -144,6 +515,9 @@ pcomm_result_t _pcomm_add_output_fd( list_t *list, int fd, int check_only,
                         memcpy( fd_context->buffer + fd_context->used, data, length );
                         fd_context->length = fd_context->used + length;
                         fd_context->used = fd_context->used + length;
+                        if ( fd_context->used > fd_context->stats.write_queue_max ) {
+                            fd_context->stats.write_queue_max = fd_context->used;
+                        }
                     }
                 }
             }
@@ -161,6 +535,8 @@ pcomm_result_t _pcomm_add_output_fd( list_t *list, int fd, int check_only,
             fd_context->used     = 0;
             fd_context->offset   = 0;
             fd_context->check_only = check_only;
+            fd_context->idle_timer.level = PCOMM_TIMER_UNLINKED;
+            fd_context->deadline_timer.level = PCOMM_TIMER_UNLINKED;
 
             // Check if we are handling I/O
             if (!fd_context->check_only) {
@@ -174,6 +550,7 @@ pcomm_result_t _pcomm_add_output_fd( list_t *list, int fd, int check_only,
                     memcpy( fd_context->buffer, data, length );
                     fd_context->length = length;
                     fd_context->used = length;
+                    fd_context->stats.write_queue_max = length;
                 }
             }
             if (result == PCOMM_SUCCESS) {
@@ -198,7 +575,39 @@ pcomm_fd_t *_pcomm_get_fd( list_t *list, int fd )
     return fd_context;
 }
 
-pcomm_result_t _pcomm_remove_fd( list_t *list, int fd ) 
+/* Free a descriptor context that has left its list. A callback may remove
+ * its own descriptor while dispatch still holds the context and the read
+ * buffer it was handed, so during dispatch the context is only marked and
+ * set aside until dispatch is done.
+ */
+void _pcomm_release_fd( pcomm_context_t *context, pcomm_fd_t *fd_context )
+{
+    if ( context->dispatching ) {
+        fd_context->removed = 1;
+        fd_context->retired = context->retired;
+        context->retired = fd_context;
+    } else {
+        if ( fd_context->buffer ) {
+            free( fd_context->buffer );
+        }
+        free( fd_context );
+    }
+}
+
+void _pcomm_free_retired( pcomm_context_t *context )
+{
+    pcomm_fd_t *fd_context;
+
+    while ( (fd_context = context->retired) ) {
+        context->retired = fd_context->retired;
+        if ( fd_context->buffer ) {
+            free( fd_context->buffer );
+        }
+        free( fd_context );
+    }
+}
+
+pcomm_result_t _pcomm_remove_fd( pcomm_context_t *context, list_t *list, int fd ) 
 {
     pcomm_result_t result = PCOMM_SUCCESS;
     int index = -1;
@@ -216,7 +625,9 @@ pcomm_result_t _pcomm_remove_fd( list_t *list, int fd )
     } else if ( (delete_result = list_delete_at(list, (unsigned int)index)) < 0 ) {
         result = PCOMM_LIST_REMOVE_FAILED;
     } else {
-        free(fd_context);
+        _pcomm_timer_unlink( &context->timers, &fd_context->idle_timer );
+        _pcomm_timer_unlink( &context->timers, &fd_context->deadline_timer );
+        _pcomm_release_fd( context, fd_context );
     }
     
     return result;
@@ -231,11 +642,11 @@ pcomm_result_t _pcomm_remove_fd_type( pcomm_context_t *context, int fd, pcomm_st
         result = PCOMM_UNINITIALIZED_CONTEXT;
     } else {
         if (type == PCOMM_STREAM_WRITE) {
-            result = _pcomm_remove_fd(&context->write_fds, fd);
+            result = _pcomm_remove_fd(context, &context->write_fds, fd);
         } else if (type == PCOMM_STREAM_READ) {
-            result = _pcomm_remove_fd(&context->read_fds, fd);
+            result = _pcomm_remove_fd(context, &context->read_fds, fd);
         } else if (type == PCOMM_STREAM_ERROR) {
-            result = _pcomm_remove_fd(&context->error_fds, fd);
+            result = _pcomm_remove_fd(context, &context->error_fds, fd);
         } else {
             result = PCOMM_INVALID_STREAM_TYPE;
         }
@@ -243,7 +654,21 @@ pcomm_result_t _pcomm_remove_fd_type( pcomm_context_t *context, int fd, pcomm_st
     return result;
 }
 
-pcomm_result_t _pcomm_empty_list( list_t *list ) {
+/* Remove a descriptor and then tell its owner it is gone. The callback is
+ * fetched first because removal releases the descriptor context.
+ */
+void _pcomm_close_fd( pcomm_context_t *context, list_t *list, pcomm_fd_t *fd_context )
+{
+    pcomm_callback_ready close_callback = fd_context->close_callback;
+    int fd = fd_context->file_descriptor;
+
+    _pcomm_trace( context, PCOMM_TRACE_CLOSE, fd, 0 );
+    if ( (_pcomm_remove_fd(context, list, fd) == PCOMM_SUCCESS) && close_callback ) {
+        close_callback( context, fd );
+    }
+}
+
+pcomm_result_t _pcomm_empty_list( pcomm_context_t *context, list_t *list ) {
     pcomm_result_t result = PCOMM_SUCCESS;
     pcomm_fd_t *fd_context = NULL;
 
@@ -255,9 +680,14 @@ pcomm_result_t _pcomm_empty_list( list_t *list ) {
         while ( list_iterator_hasnext(list) ) {
             fd_context = list_iterator_next(list);
             if ( fd_context ) {
+                _pcomm_timer_unlink( &context->timers, &fd_context->idle_timer );
+                _pcomm_timer_unlink( &context->timers, &fd_context->deadline_timer );
                 if ( fd_context->buffer ) {
                     free( fd_context->buffer );
                 }
+                if ( fd_context->expired_callback ) {
+                    close( fd_context->file_descriptor );
+                }
                 free( fd_context );
             }
         }
@@ -345,18 +775,39 @@ pcomm_result_t _pcomm_clean_read_buffer( pcomm_fd_t *fd_context )
     return result;
 }
 
+/* a read or write that keeps the descriptor's syscall counters */
+ssize_t _pcomm_fd_io( pcomm_fd_t *fd_context, uint8_t *buffer, size_t size, int writing )
+{
+    ssize_t count;
+
+    if (writing) {
+        fd_context->stats.writes++;
+        count = write( fd_context->file_descriptor, buffer, size );
+    } else {
+        fd_context->stats.reads++;
+        count = read( fd_context->file_descriptor, buffer, size );
+    }
+    if ( (count < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ) {
+        fd_context->stats.eagains++;
+    }
+    return count;
+}
+
 pcomm_result_t _read_fd( pcomm_fd_t *fd_context, size_t page_size )
 {
     pcomm_result_t result = PCOMM_SUCCESS;
     uint8_t *new_buffer = NULL;
     uint8_t *buffer = NULL;
-    size_t read_count = 0;
+    ssize_t read_count = 0;
 
     if ( !fd_context) {
         result = PCOMM_NULL_CONTEXT;
     } else if ( !(buffer = (uint8_t *)malloc(page_size)) ) {
         result = PCOMM_OUT_OF_MEMORY;
-    } else if ( (read_count = read(fd_context->file_descriptor, buffer, page_size)) <= 0 ) {
+    } else if ( ((read_count = _pcomm_fd_io( fd_context, buffer, page_size, 0 )) < 0) &&
+                ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ) {
+        result = PCOMM_FD_WOULD_BLOCK;
+    } else if ( read_count <= 0 ) {
         result = PCOMM_NO_DATA_FROM_READ;
     } else if ( !(new_buffer = realloc( fd_context->buffer, fd_context->used + read_count )) ) {
         result = PCOMM_OUT_OF_MEMORY;
@@ -365,7 +816,12 @@ pcomm_result_t _read_fd( pcomm_fd_t *fd_context, size_t page_size )
         memcpy( fd_context->buffer + fd_context->used, buffer, read_count );
         fd_context->length = fd_context->used + read_count;
         fd_context->used = fd_context->used + read_count;
+        fd_context->stats.bytes_in += (uint64_t)read_count;
+        if ( fd_context->used > fd_context->stats.read_buffer_max ) {
+            fd_context->stats.read_buffer_max = fd_context->used;
+        }
     }
+    free( buffer );
 
     return result;
 }
@@ -374,7 +830,7 @@ pcomm_result_t _write_fd( pcomm_fd_t *fd_context )
 {
     pcomm_result_t result = PCOMM_SUCCESS;
     uint8_t *new_buffer = NULL;
-    size_t write_count = 0;
+    ssize_t write_count = 0;
 
     if ( !fd_context ) { 
         result = PCOMM_NULL_CONTEXT;
@@ -382,9 +838,14 @@ pcomm_result_t _write_fd( pcomm_fd_t *fd_context )
         result = PCOMM_NULL_BUFFER;
     } else if ( !fd_context->used ) {
         result = PCOMM_NO_DATA_FOR_WRITE;
-    } else if ( !(write_count = write(fd_context->file_descriptor, fd_context->buffer, fd_context->used)) ) {
+    } else if ( ((write_count = _pcomm_fd_io( fd_context, fd_context->buffer,
+                                              fd_context->used, 1 )) < 0) &&
+                ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ) {
+        result = PCOMM_FD_WOULD_BLOCK;
+    } else if ( write_count <= 0 ) {
         result = PCOMM_FD_WRITE_FAILED;
     } else {
+        fd_context->stats.bytes_out += (uint64_t)write_count;
         /* Update the number of bytes left, if empty, null out buffer */
         if ( write_count == fd_context->used ) {
             free(fd_context->buffer);
@@ -415,6 +876,90 @@ long _bytes_on_socket(int socket)
 }
 
 
+list_t *_pcomm_stream_list( pcomm_context_t *context, pcomm_stream_t type )
+{
+    switch (type) {
+        case PCOMM_STREAM_WRITE:
+            return &context->write_fds;
+        case PCOMM_STREAM_READ:
+            return &context->read_fds;
+        case PCOMM_STREAM_ERROR:
+            return &context->error_fds;
+    }
+    return NULL;
+}
+
+/* Idle and lifetime timers embedded in a descriptor context. Activity only
+ * records a timestamp; an idle timer that comes due early is pushed back to
+ * the remaining time instead of being re-filed on every event.
+ */
+void _pcomm_fd_expired( pcomm_context_t *context, pcomm_timer_t *timer, void *arg )
+{
+    pcomm_fd_t *fd_context = (pcomm_fd_t *)arg;
+    list_t *list = _pcomm_stream_list( context, fd_context->stream );
+
+    if ( (timer == &fd_context->idle_timer) &&
+         ((fd_context->last_activity + fd_context->idle_timeout) > timer->expires) ) {
+        timer->expires = fd_context->last_activity + fd_context->idle_timeout;
+        _pcomm_timer_link( &context->timers, timer );
+    } else if (list) {
+        _pcomm_trace( context, PCOMM_TRACE_EXPIRED, fd_context->file_descriptor, 0 );
+        _pcomm_close_fd( context, list, fd_context );
+    }
+}
+
+pcomm_result_t _pcomm_fd_arm( pcomm_context_t *context, pcomm_stream_t type, int fd,
+                              uint64_t timeout_ms, int idle )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+    pcomm_fd_t *fd_context = NULL;
+    pcomm_timer_t *timer = NULL;
+    list_t *list = NULL;
+
+    if (!context) {
+        result = PCOMM_NULL_CONTEXT;
+    } else if (!context->initialized) {
+        result = PCOMM_UNINITIALIZED_CONTEXT;
+    } else if ( !(list = _pcomm_stream_list(context, type)) ) {
+        result = PCOMM_INVALID_STREAM_TYPE;
+    } else if ( fd < 0 ) {
+        result = PCOMM_FD_NEGATIVE;
+    } else if ( !(fd_context = _pcomm_get_fd(list, fd)) ) {
+        result = PCOMM_FD_NOT_FOUND;
+    } else {
+        timer = idle ? &fd_context->idle_timer : &fd_context->deadline_timer;
+        _pcomm_timer_unlink( &context->timers, timer );
+        fd_context->stream = type;
+        if (idle) {
+            fd_context->idle_timeout = timeout_ms;
+            fd_context->last_activity = _pcomm_now_ms( context );
+        }
+        // a zero timeout just disarms the timer
+        if (timeout_ms) {
+            if ( !context->timers.count && (_pcomm_now_ms( context ) > context->timers.current) ) {
+                context->timers.current = _pcomm_now_ms( context );
+            }
+            timer->expires  = _pcomm_timer_deadline( context, timeout_ms );
+            timer->interval = 0;
+            timer->callback = _pcomm_fd_expired;
+            timer->arg      = fd_context;
+            _pcomm_timer_link( &context->timers, timer );
+        }
+    }
+
+    return result;
+}
+
+/* Add callback time to a descriptor's counters. A callback that removed
+ * its descriptor leaves the context retired but valid until dispatch ends.
+ */
+void _pcomm_charge_callback( pcomm_fd_t *fd_context, uint64_t elapsed )
+{
+    if ( !fd_context->removed ) {
+        fd_context->stats.callback_ns += elapsed;
+    }
+}
+
 /* Manage I/O and callbacks for all selected file descriptors */
 void _process_selected_fds( pcomm_context_t *context,
                             pcomm_stream_t stream,
@@ -423,6 +968,9 @@ void _process_selected_fds( pcomm_context_t *context,
     list_t *stream_fds;
 
     int io_result;
+    uint64_t expirations;
+    uint64_t start;
+    size_t pending;
     int *fds = NULL;
     size_t fds_len = 0;
 
@@ -448,56 +996,96 @@ void _process_selected_fds( pcomm_context_t *context,
     }
 
     if ( !_pcomm_make_fd_list(stream_fds, &fds, &fds_len) ) {
+        context->dispatching++;
         for ( i=0; (i<fds_len) && (!context->exit_now); i++ ) {
             if ( FD_ISSET(fds[i], set_ptr) ) {
                 if ( (fd_context = (pcomm_fd_t *)list_seek(stream_fds, &fds[i])) ) {
-                    // Check if we are only notifying that fd is ready
-                    if (fd_context->check_only) {
-                        if (context->debug) {
-                            fprintf(stderr, "File descriptor %d is ready\n", fd_context->file_descriptor);
+                    PCOMM_PROBE3( fd__dispatch, context, fds[i], (int)stream );
+                    // Any event counts as activity for the idle timeout
+                    if (fd_context->idle_timeout) {
+                        fd_context->last_activity = _pcomm_now_ms( context );
+                    }
+                    // Timer descriptors deliver their expiration count
+                    if (fd_context->expired_callback) {
+                        if ( read(fd_context->file_descriptor, &expirations,
+                                  sizeof(expirations)) == sizeof(expirations) ) {
+                            start = _pcomm_enter( context, PCOMM_HIST_IO, fds[i] );
+                            fd_context->expired_callback( context,
+                                                          fd_context->file_descriptor,
+                                                          expirations );
+                            _pcomm_charge_callback( fd_context,
+                                _pcomm_leave( context, PCOMM_HIST_IO, start ) );
                         }
+                    }
+                    // Check if we are only notifying that fd is ready
+                    else if (fd_context->check_only) {
+                        _pcomm_trace( context, PCOMM_TRACE_READY, fds[i], 0 );
                         if (fd_context->ready_callback) {
+                            start = _pcomm_enter( context, PCOMM_HIST_IO, fds[i] );
                             fd_context->ready_callback( context,
                                                         fd_context->file_descriptor );
+                            _pcomm_charge_callback( fd_context,
+                                _pcomm_leave( context, PCOMM_HIST_IO, start ) );
                         }
                     }
                     // Otherwise we try to perform I/O on this fd
                     else {
                         if (stream == PCOMM_STREAM_WRITE) {
+                            pending = fd_context->used;
                             io_result = _write_fd( fd_context );
+                            if (!io_result) {
+                                context->stats.writes++;
+                                context->stats.bytes_written += pending - fd_context->used;
+                                _pcomm_trace( context, PCOMM_TRACE_WRITE, fds[i],
+                                              (int64_t)(pending - fd_context->used) );
+                                PCOMM_PROBE3( write, context, fds[i], pending - fd_context->used );
+                            } else {
+                                _pcomm_trace( context, PCOMM_TRACE_IO_FAILED, fds[i], io_result );
+                            }
                             if ( fd_context->io_callback ) {
+                                start = _pcomm_enter( context, PCOMM_HIST_IO, fds[i] );
                                 fd_context->io_callback( context, 
                                                       fd_context->file_descriptor,
                                                       NULL, 0);
+                                _pcomm_charge_callback( fd_context,
+                                    _pcomm_leave( context, PCOMM_HIST_IO, start ) );
                             }
-                            if ( !fd_context->buffer || !fd_context->used ) {
-                                _pcomm_remove_fd( &context->write_fds, 
-                                                  fd_context->file_descriptor );
-                                if (fd_context->close_callback) {
-                                    fd_context->close_callback(context,
-                                                               fd_context->file_descriptor);
-                                }
-                                free(fd_context);
+                            // a hard write error leaves the fd writable
+                            // for good, so it is closed like a finished one
+                            if ( !fd_context->removed &&
+                                 ((io_result == PCOMM_FD_WRITE_FAILED) ||
+                                  !fd_context->buffer || !fd_context->used) ) {
+                                _pcomm_close_fd( context, &context->write_fds, fd_context );
                             }
                         }
                         else {
+                            pending = fd_context->used;
                             io_result = _read_fd( fd_context, context->page_size );
                             if (!io_result) {
+                                context->stats.reads++;
+                                context->stats.bytes_read += fd_context->used - pending;
+                                _pcomm_trace( context, PCOMM_TRACE_READ, fds[i],
+                                              (int64_t)(fd_context->used - pending) );
+                                PCOMM_PROBE3( read, context, fds[i], fd_context->used - pending );
                                 fd_context->last_read_empty = 0;
                                 if (fd_context->io_callback ) {
+                                    start = _pcomm_enter( context, PCOMM_HIST_IO, fds[i] );
                                     fd_context->io_callback( context, 
                                                           fd_context->file_descriptor, 
                                                           fd_context->buffer, 
                                                           fd_context->used );
-                                    _pcomm_clean_read_buffer( fd_context );
+                                    _pcomm_charge_callback( fd_context,
+                                        _pcomm_leave( context, PCOMM_HIST_IO, start ) );
+                                    if ( !fd_context->removed ) {
+                                        _pcomm_clean_read_buffer( fd_context );
+                                    }
                                 }
-                            } else if (io_result == PCOMM_NO_DATA_FROM_READ) {
+                            } else {
+                                _pcomm_trace( context, PCOMM_TRACE_IO_FAILED, fds[i], io_result );
+                            }
+                            if (io_result == PCOMM_NO_DATA_FROM_READ) {
                                 if (fd_context->last_read_empty) {
-                                    pcomm_remove_read_fd(context, fd_context->file_descriptor);
-                                    if (fd_context->close_callback) {
-                                        fd_context->close_callback(context,
-                                                                   fd_context->file_descriptor);
-                                    }
+                                    _pcomm_close_fd( context, stream_fds, fd_context );
                                 } else {
                                     fd_context->last_read_empty = 1;
                                 }
@@ -510,250 +1098,1737 @@ void _process_selected_fds( pcomm_context_t *context,
         free(fds);
         fds = NULL;
         fds_len = 0;
+        if ( !--context->dispatching ) {
+            _pcomm_free_retired( context );
+        }
     }
 }
 
-/* The real magic happens here */
-pcomm_result_t _pcomm_loop( pcomm_context_t *context ) {
-    pcomm_result_t result = PCOMM_SUCCESS;
-    int read_max, write_max, error_max;
-    int max_fd;
-    int num_fds;
-    struct timeval timeout;
+/* Maximum number of posted tasks run per loop iteration, so a flood of
+ * posts cannot starve descriptors and timers.
+ */
+#define PCOMM_TASK_BATCH 256
 
-    fd_set read_set;
-    fd_set write_set;
-    fd_set error_set;
+void _pcomm_queue_init( struct PCOMM_QUEUE *queue )
+{
+    queue->stub.next = NULL;
+    queue->head = &queue->stub;
+    queue->tail = &queue->stub;
+}
 
-    fd_set *read_set_ptr;
-    fd_set *write_set_ptr;
-    fd_set *error_set_ptr;
+void _pcomm_queue_push( struct PCOMM_QUEUE *queue, pcomm_task_t *task )
+{
+    pcomm_task_t *prev;
 
-    if ( !context ) {
-        fprintf( stderr, "Context null!\n" );
-        return PCOMM_NULL_CONTEXT;
-    }
+    __atomic_store_n( &task->next, NULL, __ATOMIC_RELAXED );
+    prev = __atomic_exchange_n( &queue->head, task, __ATOMIC_SEQ_CST );
+    __atomic_store_n( &prev->next, task, __ATOMIC_RELEASE );
+}
 
-    while (!context->exit_now)
- // PCOMM LOOP
-    {
-        if (context->exit_request  && !_pcomm_writes_buffered(context)) {
-            context->exit_now = 1;
-            continue;
-        }
+/* Take the oldest task, or NULL if there is none. A producer that has
+ * swapped the head but not yet linked its node makes the queue look empty
+ * for a moment; _pcomm_queue_pending still reports it.
+ */
+pcomm_task_t *_pcomm_queue_pop( struct PCOMM_QUEUE *queue )
+{
+    pcomm_task_t *tail = queue->tail;
+    pcomm_task_t *next = __atomic_load_n( &tail->next, __ATOMIC_ACQUIRE );
 
-        // call the preparation routine if supplied
-        if (context->prepare_callback) {
-            context->prepare_callback(context);
+    if ( tail == &queue->stub ) {
+        if ( !next ) {
+            return NULL;
         }
+        queue->tail = next;
+        tail = next;
+        next = __atomic_load_n( &next->next, __ATOMIC_ACQUIRE );
+    }
+    if ( next ) {
+        queue->tail = next;
+        return tail;
+    }
+    if ( tail != __atomic_load_n(&queue->head, __ATOMIC_SEQ_CST) ) {
+        return NULL;
+    }
+    // tail is the last node, put the stub behind it so it can be detached
+    _pcomm_queue_push( queue, &queue->stub );
+    next = __atomic_load_n( &tail->next, __ATOMIC_ACQUIRE );
+    if ( next ) {
+        queue->tail = next;
+        return tail;
+    }
+    return NULL;
+}
 
-        if (context->exit_now) {
-            continue;
-        }
+int _pcomm_queue_pending( struct PCOMM_QUEUE *queue )
+{
+    return (queue->tail != &queue->stub) ||
+           (__atomic_load_n(&queue->head, __ATOMIC_SEQ_CST) != &queue->stub);
+}
 
-        // populate write fds
-        max_fd = -1;
-        write_max = _pcomm_populate_set( &context->write_fds, &write_set );
-        max_fd = (write_max > max_fd) ? write_max : max_fd;
+/* queue a task for the loop, waking it only if it may be asleep */
+pcomm_result_t _pcomm_enqueue( pcomm_context_t *context, pcomm_task_t *task )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
 
-        // do not process reads if we are trying to exit cleanly!
-        if (!context->exit_request) {
-            // populate read fds
-            read_max = _pcomm_populate_set( &context->read_fds, &read_set );
-            max_fd = (read_max > max_fd) ? read_max : max_fd;
+    _pcomm_queue_push( &context->tasks, task );
+    if ( __atomic_load_n(&context->sleeping, __ATOMIC_SEQ_CST) ) {
+        result = pcomm_wakeup( context );
+    }
 
-            // populate error fds
-            error_max = _pcomm_populate_set( &context->error_fds, &error_set );
-            max_fd = (error_max > max_fd) ? error_max : max_fd;
-        }
-        else {
-            read_max = -1;
-            error_max = -1;
-        }
+    return result;
+}
+
+void _pcomm_run_tasks( pcomm_context_t *context )
+{
+    pcomm_task_t *task;
+    uint64_t start;
+    int count = 0;
+
+    while ( (count++ < PCOMM_TASK_BATCH) && !context->exit_now &&
+            (task = _pcomm_queue_pop(&context->tasks)) ) {
+        context->stats.tasks_run++;
+        start = _pcomm_enter( context, PCOMM_HIST_TASK, -1 );
+        task->callback( context, task->arg );
+        _pcomm_leave( context, PCOMM_HIST_TASK, start );
+        free( task );
+    }
+}
+
+void _pcomm_free_tasks( pcomm_context_t *context )
+{
+    pcomm_task_t *task;
+
+    while ( (task = _pcomm_queue_pop(&context->tasks)) ) {
+        free( task );
+    }
+}
+
+/* Offload pool. Every worker owns a deque guarded by its own lock; new jobs
+ * are dealt to the deques round-robin and a worker that runs dry steals from
+ * the others, so one long job never strands the work queued behind it. Both
+ * the owner and thieves take the oldest job first since every job comes from
+ * the loop and the oldest one is the one adding to tail latency. Each
+ * finished job is handed back to the loop through the task queue.
+ */
+void _pcomm_offload_done( pcomm_context_t *context, void *arg )
+{
+    struct PCOMM_JOB *job = (struct PCOMM_JOB *)arg;
+
+    context->offload.outstanding--;
+    if ( job->done_callback ) {
+        job->done_callback( context, job->arg );
+    }
+}
+
+pcomm_result_t _pcomm_deque_push( struct PCOMM_DEQUE *deque, struct PCOMM_JOB *job )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+    struct PCOMM_JOB **jobs;
+    size_t capacity;
+    size_t i;
+
+    pthread_mutex_lock( &deque->lock );
+    if ( deque->count == deque->capacity ) {
+        capacity = deque->capacity ? (deque->capacity * 2) : 64;
+        if ( !(jobs = malloc( capacity * sizeof(struct PCOMM_JOB *) )) ) {
+            result = PCOMM_OUT_OF_MEMORY;
+        } else {
+            // unwrap the ring into the front of the new buffer
+            for ( i = 0; i < deque->count; i++ ) {
+                jobs[i] = deque->jobs[(deque->head + i) % deque->capacity];
+            }
+            free( deque->jobs );
+            deque->jobs = jobs;
+            deque->capacity = capacity;
+            deque->head = 0;
+        }
+    }
+    if ( result == PCOMM_SUCCESS ) {
+        deque->jobs[(deque->head + deque->count) % deque->capacity] = job;
+        __atomic_add_fetch( &deque->count, 1, __ATOMIC_RELAXED );
+    }
+    pthread_mutex_unlock( &deque->lock );
+
+    return result;
+}
+
+struct PCOMM_JOB *_pcomm_deque_take( struct PCOMM_DEQUE *deque )
+{
+    struct PCOMM_JOB *job = NULL;
+
+    // cheap unlocked peek so thieves skip empty deques without contending
+    if ( !__atomic_load_n( &deque->count, __ATOMIC_RELAXED ) ) {
+        return NULL;
+    }
+    pthread_mutex_lock( &deque->lock );
+    if ( deque->count ) {
+        job = deque->jobs[deque->head];
+        deque->head = (deque->head + 1) % deque->capacity;
+        __atomic_sub_fetch( &deque->count, 1, __ATOMIC_RELAXED );
+    }
+    pthread_mutex_unlock( &deque->lock );
+
+    return job;
+}
+
+/* look in the worker's own deque first, then try every other one */
+struct PCOMM_JOB *_pcomm_pool_find( struct PCOMM_POOL *pool, size_t self )
+{
+    struct PCOMM_JOB *job;
+    size_t i;
+
+    if ( (job = _pcomm_deque_take( &pool->deques[self] )) ) {
+        return job;
+    }
+    for ( i = 1; i < pool->capacity; i++ ) {
+        if ( (job = _pcomm_deque_take( &pool->deques[(self + i) % pool->capacity] )) ) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+struct PCOMM_WORKER {
+    pcomm_context_t *context;
+    size_t index;
+};
+
+void *_pcomm_pool_worker( void *arg )
+{
+    struct PCOMM_WORKER *worker = (struct PCOMM_WORKER *)arg;
+    pcomm_context_t *context = worker->context;
+    struct PCOMM_POOL *pool = &context->offload;
+    size_t self = worker->index;
+    struct PCOMM_JOB *job;
+
+    free( worker );
+    for (;;) {
+        if ( (job = _pcomm_pool_find( pool, self )) ) {
+            __atomic_sub_fetch( &pool->queued, 1, __ATOMIC_SEQ_CST );
+            job->job_callback( job->arg );
+            job->task.callback = _pcomm_offload_done;
+            job->task.arg = job;
+            _pcomm_enqueue( context, &job->task );
+            continue;
+        }
+
+        // Register as idle before the final check; pcomm_offload counts the
+        // job before it looks for idle workers, so one side sees the other.
+        pthread_mutex_lock( &pool->lock );
+        __atomic_add_fetch( &pool->idle, 1, __ATOMIC_SEQ_CST );
+        if ( !__atomic_load_n( &pool->queued, __ATOMIC_SEQ_CST ) ) {
+            // queued jobs are finished before a stopping worker exits
+            if ( pool->stopping ) {
+                __atomic_sub_fetch( &pool->idle, 1, __ATOMIC_SEQ_CST );
+                pthread_mutex_unlock( &pool->lock );
+                break;
+            }
+            pthread_cond_wait( &pool->ready, &pool->lock );
+        }
+        __atomic_sub_fetch( &pool->idle, 1, __ATOMIC_SEQ_CST );
+        pthread_mutex_unlock( &pool->lock );
+    }
+
+    return NULL;
+}
+
+void _pcomm_pool_stop( pcomm_context_t *context )
+{
+    struct PCOMM_POOL *pool = &context->offload;
+    size_t i;
+
+    if ( !pool->threads ) {
+        return;
+    }
+    pthread_mutex_lock( &pool->lock );
+    pool->stopping = 1;
+    pthread_cond_broadcast( &pool->ready );
+    pthread_mutex_unlock( &pool->lock );
+    for ( i = 0; i < pool->size; i++ ) {
+        pthread_join( pool->threads[i], NULL );
+    }
+    for ( i = 0; i < pool->capacity; i++ ) {
+        free( pool->deques[i].jobs );
+        pthread_mutex_destroy( &pool->deques[i].lock );
+    }
+    free( pool->deques );
+    free( pool->threads );
+    pool->deques = NULL;
+    pool->threads = NULL;
+    pool->size = 0;
+    pool->capacity = 0;
+    pthread_cond_destroy( &pool->ready );
+    pthread_mutex_destroy( &pool->lock );
+}
+
+pcomm_result_t _pcomm_pool_start( pcomm_context_t *context, size_t threads )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+    struct PCOMM_POOL *pool = &context->offload;
+    struct PCOMM_WORKER *worker;
+    size_t i;
+
+    if ( !(pool->threads = calloc( sizeof(pthread_t), threads )) ) {
+        return PCOMM_OUT_OF_MEMORY;
+    }
+    if ( !(pool->deques = calloc( sizeof(struct PCOMM_DEQUE), threads )) ) {
+        free( pool->threads );
+        pool->threads = NULL;
+        return PCOMM_OUT_OF_MEMORY;
+    }
+    pool->capacity = threads;
+    for ( i = 0; i < threads; i++ ) {
+        pthread_mutex_init( &pool->deques[i].lock, NULL );
+    }
+    pthread_mutex_init( &pool->lock, NULL );
+    pthread_cond_init( &pool->ready, NULL );
+    pool->stopping = 0;
+    pool->queued = 0;
+    pool->idle = 0;
+    pool->next = 0;
+
+    for ( pool->size = 0; pool->size < threads; pool->size++ ) {
+        if ( !(worker = malloc( sizeof(struct PCOMM_WORKER) )) ) {
+            result = PCOMM_OUT_OF_MEMORY;
+            break;
+        }
+        worker->context = context;
+        worker->index = pool->size;
+        if ( pthread_create( &pool->threads[pool->size], NULL,
+                             _pcomm_pool_worker, worker ) ) {
+            free( worker );
+            result = PCOMM_THREAD_FAILED;
+            break;
+        }
+    }
+
+    // a partial pool is still a working pool, an empty one is torn down
+    if ( pool->size ) {
+        result = PCOMM_SUCCESS;
+    } else {
+        _pcomm_pool_stop( context );
+    }
+
+    return result;
+}
+
+/* clear the wakeup counter so the next select can block again */
+void _pcomm_drain_wakeup( pcomm_context_t *context )
+{
+    uint64_t count;
+
+    while ( read(context->wake_fd, &count, sizeof(count)) == sizeof(count) ) {
+        // EFD_NONBLOCK: stop once the counter is empty
+    }
+    // Cleared only after draining: a waker that still sees the flag set
+    // knows the loop is awake and will look at its state before blocking.
+    __atomic_store_n( &context->wake_pending, 0, __ATOMIC_SEQ_CST );
+}
+
+/* fold the gap since the previous event into the running average (1/8
+ * weight, as TCP does for its RTT estimate)
+ */
+void _pcomm_busy_poll_event( pcomm_context_t *context, uint64_t now )
+{
+    uint64_t gap = now - context->last_event_us;
+
+    if ( gap > context->busy_poll_gap_us ) {
+        context->busy_poll_gap_us += (gap - context->busy_poll_gap_us) / 8;
+    } else {
+        context->busy_poll_gap_us -= (context->busy_poll_gap_us - gap) / 8;
+    }
+    context->last_event_us = now;
+}
+
+/* Spin while the next event is expected within the window; when events are
+ * further apart than the longest allowed spin, spinning would only burn the
+ * core before sleeping anyway.
+ */
+int _pcomm_busy_poll_spin( pcomm_context_t *context, uint64_t now )
+{
+    uint64_t window = context->busy_poll_gap_us * 2;
+
+    if ( !context->busy_poll_us || (window > context->busy_poll_us) ) {
+        return 0;
+    }
+    return (now - context->last_event_us) < window;
+}
+
+/* Signals read per call; a storm costs one read for each batch this size */
+#define PCOMM_SIGNAL_BATCH 16
+
+void _pcomm_read_signals( pcomm_context_t *context )
+{
+    struct signalfd_siginfo infos[PCOMM_SIGNAL_BATCH];
+    pcomm_callback_signal callback;
+    ssize_t length;
+    uint64_t start;
+    size_t count;
+    size_t i;
+
+    if ( (length = read(context->signal_fd, infos, sizeof(infos))) <= 0 ) {
+        return;
+    }
+    count = (size_t)length / sizeof(struct signalfd_siginfo);
+    for ( i = 0; (i < count) && !context->exit_now; i++ ) {
+        if ( (infos[i].ssi_signo < NSIG) &&
+             (callback = context->signal_callbacks[infos[i].ssi_signo]) ) {
+            context->stats.signals++;
+            start = _pcomm_enter( context, PCOMM_HIST_SIGNAL, -1 );
+            callback( context, (int)infos[i].ssi_signo, &infos[i] );
+            _pcomm_leave( context, PCOMM_HIST_SIGNAL, start );
+        }
+    }
+}
+
+void _pcomm_count_select( pcomm_context_t *context, int num_fds )
+{
+    pcomm_stats_t *stats = &context->stats;
+
+    stats->iterations++;
+    if ( num_fds > 0 ) {
+        stats->wakeups++;
+        stats->ready_fds += (uint64_t)num_fds;
+        if ( (uint64_t)num_fds > stats->max_ready_fds ) {
+            stats->max_ready_fds = (uint64_t)num_fds;
+        }
+    } else if ( num_fds == 0 ) {
+        stats->timeouts++;
+    } else if ( errno == EINTR ) {
+        stats->interrupts++;
+    }
+}
+
+/* Watchdog. The loop stamps the start of each busy stretch (from the clock
+ * sample it takes anyway) and the callback it is in; the watchdog thread
+ * wakes a few times per threshold and, on an overrun, interrupts the loop
+ * thread with PCOMM_WATCHDOG_SIGNAL so it records its own backtrace.
+ */
+__thread struct PCOMM_WATCHDOG *_pcomm_watched = NULL;
+
+/* The handler is process-wide, so it is installed by the first running
+ * watchdog and the application's own disposition restored after the last.
+ */
+pthread_mutex_t _pcomm_watchdog_handler_lock = PTHREAD_MUTEX_INITIALIZER;
+size_t _pcomm_watchdog_handler_users = 0;
+struct sigaction _pcomm_watchdog_previous;
+
+void _pcomm_watchdog_capture( int signo )
+{
+    struct PCOMM_WATCHDOG *watchdog = _pcomm_watched;
+    int saved_errno = errno;
+
+    if ( watchdog ) {
+        watchdog->depth = backtrace( watchdog->frames, PCOMM_STALL_FRAMES );
+        __atomic_store_n( &watchdog->captured, 1, __ATOMIC_RELEASE );
+    }
+    errno = saved_errno;
+}
+
+/* called on the loop thread whenever it starts running callbacks */
+void _pcomm_watchdog_attach( pcomm_context_t *context )
+{
+    struct PCOMM_WATCHDOG *watchdog = &context->watchdog;
+
+    _pcomm_watched = watchdog;
+    if ( !__atomic_load_n( &watchdog->loop_known, __ATOMIC_ACQUIRE ) ||
+         !pthread_equal( watchdog->loop_thread, pthread_self() ) ) {
+        __atomic_store_n( &watchdog->loop_known, 0, __ATOMIC_RELEASE );
+        watchdog->loop_thread = pthread_self();
+        __atomic_store_n( &watchdog->loop_known, 1, __ATOMIC_RELEASE );
+    }
+}
+
+/* called on the loop thread as it leaves the loop; once this returns the
+ * watchdog no longer signals the thread, which may go on to exit
+ */
+void _pcomm_watchdog_detach( pcomm_context_t *context )
+{
+    struct PCOMM_WATCHDOG *watchdog = &context->watchdog;
+
+    // the watchdog holds the lock from its check until the signal is handled
+    if ( watchdog->running ) {
+        pthread_mutex_lock( &watchdog->lock );
+    }
+    __atomic_store_n( &watchdog->loop_known, 0, __ATOMIC_RELEASE );
+    __atomic_store_n( &watchdog->busy_since, 0, __ATOMIC_RELAXED );
+    if ( watchdog->running ) {
+        pthread_mutex_unlock( &watchdog->lock );
+    }
+    if ( _pcomm_watched == watchdog ) {
+        _pcomm_watched = NULL;
+    }
+}
+
+/* The watchdog compares against CLOCK_MONOTONIC, so the pass is stamped
+ * from it rather than from a coarse cached sample.
+ */
+void _pcomm_watchdog_pass( pcomm_context_t *context )
+{
+    if ( context->watchdog.running ) {
+        __atomic_add_fetch( &context->watchdog.pass, 1, __ATOMIC_RELAXED );
+        __atomic_store_n( &context->watchdog.busy_since, _pcomm_clock_ns(), __ATOMIC_RELAXED );
+    }
+}
+
+void _pcomm_watchdog_report( pcomm_context_t *context, const pcomm_stall_t *stall )
+{
+    fprintf( stderr, "pcomm: loop stalled for %llu ms in callback %d (fd %d)\n",
+             (unsigned long long)(stall->elapsed_ns / 1000000ULL), (int)stall->running, stall->fd );
+    if ( stall->depth > 0 ) {
+        backtrace_symbols_fd( (void *const *)stall->frames, stall->depth, STDERR_FILENO );
+    }
+}
+
+void *_pcomm_watchdog_thread( void *arg )
+{
+    pcomm_context_t *context = (pcomm_context_t *)arg;
+    struct PCOMM_WATCHDOG *watchdog = &context->watchdog;
+    struct timespec wake_at;
+    struct timespec pause = { .tv_sec = 0, .tv_nsec = 1000000 };
+    uint64_t interval = watchdog->threshold_ns / 4;
+    uint64_t reported = 0;
+    uint64_t busy_since;
+    uint64_t pass;
+    uint64_t now;
+    int tries;
+
+    pthread_mutex_lock( &watchdog->lock );
+    while ( !watchdog->stopping ) {
+        now = _pcomm_clock_ns() + interval;
+        wake_at.tv_sec = (time_t)(now / 1000000000ULL);
+        wake_at.tv_nsec = (long)(now % 1000000000ULL);
+        pthread_cond_timedwait( &watchdog->wake, &watchdog->lock, &wake_at );
+        if ( watchdog->stopping ) {
+            break;
+        }
+
+        pass = __atomic_load_n( &watchdog->pass, __ATOMIC_RELAXED );
+        busy_since = __atomic_load_n( &watchdog->busy_since, __ATOMIC_RELAXED );
+        now = _pcomm_clock_ns();
+        if ( !busy_since || (pass == reported) || (now < busy_since) ||
+             ((now - busy_since) < watchdog->threshold_ns) ) {
+            continue;
+        }
+        reported = pass;
+
+        memset( &watchdog->stall, 0, sizeof(watchdog->stall) );
+        watchdog->stall.elapsed_ns = now - busy_since;
+        watchdog->stall.running = (pcomm_hist_t)__atomic_load_n( &watchdog->running_kind, __ATOMIC_RELAXED );
+        watchdog->stall.fd = __atomic_load_n( &watchdog->running_fd, __ATOMIC_RELAXED );
+        __atomic_store_n( &watchdog->captured, 0, __ATOMIC_RELEASE );
+        if ( __atomic_load_n( &watchdog->loop_known, __ATOMIC_ACQUIRE ) &&
+             !pthread_kill( watchdog->loop_thread, PCOMM_WATCHDOG_SIGNAL ) ) {
+            // give the loop thread a moment to run the handler
+            for ( tries = 0; (tries < 100) &&
+                  !__atomic_load_n( &watchdog->captured, __ATOMIC_ACQUIRE ); tries++ ) {
+                nanosleep( &pause, NULL );
+            }
+        }
+        if ( __atomic_load_n( &watchdog->captured, __ATOMIC_ACQUIRE ) ) {
+            watchdog->stall.depth = watchdog->depth;
+            memcpy( watchdog->stall.frames, watchdog->frames, sizeof(watchdog->frames) );
+        }
+
+        pthread_mutex_unlock( &watchdog->lock );
+        if ( watchdog->callback ) {
+            watchdog->callback( context, &watchdog->stall );
+        } else {
+            _pcomm_watchdog_report( context, &watchdog->stall );
+        }
+        pthread_mutex_lock( &watchdog->lock );
+    }
+    pthread_mutex_unlock( &watchdog->lock );
+
+    return NULL;
+}
+
+pcomm_result_t _pcomm_watchdog_install( void )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+    struct sigaction action;
+
+    pthread_mutex_lock( &_pcomm_watchdog_handler_lock );
+    if ( !_pcomm_watchdog_handler_users ) {
+        memset( &action, 0, sizeof(action) );
+        action.sa_handler = _pcomm_watchdog_capture;
+        action.sa_flags = SA_RESTART;
+        sigemptyset( &action.sa_mask );
+        if ( sigaction( PCOMM_WATCHDOG_SIGNAL, &action, &_pcomm_watchdog_previous ) ) {
+            result = PCOMM_SIGNAL_FAILED;
+        }
+    }
+    if ( result == PCOMM_SUCCESS ) {
+        _pcomm_watchdog_handler_users++;
+    }
+    pthread_mutex_unlock( &_pcomm_watchdog_handler_lock );
+
+    return result;
+}
+
+void _pcomm_watchdog_uninstall( void )
+{
+    pthread_mutex_lock( &_pcomm_watchdog_handler_lock );
+    if ( _pcomm_watchdog_handler_users && !--_pcomm_watchdog_handler_users ) {
+        sigaction( PCOMM_WATCHDOG_SIGNAL, &_pcomm_watchdog_previous, NULL );
+    }
+    pthread_mutex_unlock( &_pcomm_watchdog_handler_lock );
+}
+
+void _pcomm_watchdog_stop( pcomm_context_t *context )
+{
+    struct PCOMM_WATCHDOG *watchdog = &context->watchdog;
+
+    if ( !watchdog->running ) {
+        return;
+    }
+    pthread_mutex_lock( &watchdog->lock );
+    watchdog->stopping = 1;
+    pthread_cond_signal( &watchdog->wake );
+    pthread_mutex_unlock( &watchdog->lock );
+    pthread_join( watchdog->thread, NULL );
+    pthread_cond_destroy( &watchdog->wake );
+    pthread_mutex_destroy( &watchdog->lock );
+    watchdog->running = 0;
+    watchdog->busy_since = 0;
+    _pcomm_watchdog_uninstall();
+}
+
+pcomm_result_t _pcomm_watchdog_start( pcomm_context_t *context, uint64_t threshold_ms,
+                                      pcomm_callback_stall stall_callback )
+{
+    struct PCOMM_WATCHDOG *watchdog = &context->watchdog;
+    pthread_condattr_t attributes;
+    void *warm[1];
+
+    // backtrace loads its unwinder on first use, which is not safe from a
+    // signal handler, so make that first call here
+    backtrace( warm, 1 );
+
+    if ( _pcomm_watchdog_install() != PCOMM_SUCCESS ) {
+        return PCOMM_SIGNAL_FAILED;
+    }
+
+    watchdog->threshold_ns = threshold_ms * 1000000ULL;
+    watchdog->callback = stall_callback;
+    watchdog->stopping = 0;
+    watchdog->busy_since = 0;
+    watchdog->running_kind = PCOMM_HIST_ITERATION;
+    watchdog->running_fd = -1;
+    pthread_mutex_init( &watchdog->lock, NULL );
+    pthread_condattr_init( &attributes );
+    pthread_condattr_setclock( &attributes, CLOCK_MONOTONIC );
+    pthread_cond_init( &watchdog->wake, &attributes );
+    pthread_condattr_destroy( &attributes );
+
+    // publish before the thread can look at anything the loop stores
+    watchdog->running = 1;
+    if ( pthread_create( &watchdog->thread, NULL, _pcomm_watchdog_thread, context ) ) {
+        watchdog->running = 0;
+        pthread_cond_destroy( &watchdog->wake );
+        pthread_mutex_destroy( &watchdog->lock );
+        _pcomm_watchdog_uninstall();
+        return PCOMM_THREAD_FAILED;
+    }
+
+    return PCOMM_SUCCESS;
+}
+
+/* One pass of the loop: wait in select for at most the context's timeout
+ * (further capped by 'limit' if given) and dispatch whatever happened.
+ * Returns PCOMM_FD_NOT_FOUND when there is nothing left to wait for.
+ */
+pcomm_result_t _pcomm_iterate( pcomm_context_t *context, const struct timeval *limit )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+    int read_max, write_max, error_max;
+    int max_fd;
+    int num_fds;
+    struct timeval timeout;
+    struct timeval *timeout_ptr;
+    int64_t timer_wait;
+    int timer_timeout;
+    int spinning;
+    int woken = 0;
+    uint64_t start;
+
+    fd_set read_set;
+    fd_set write_set;
+    fd_set error_set;
+
+    fd_set *read_set_ptr;
+    fd_set *write_set_ptr;
+    fd_set *error_set_ptr;
+
+    if (context->exit_request  && !_pcomm_writes_buffered(context)) {
+        context->exit_now = 1;
+        return result;
+    }
+
+    // call the preparation routine if supplied
+    if (context->prepare_callback) {
+        start = _pcomm_enter( context, PCOMM_HIST_PREPARE, -1 );
+        context->prepare_callback(context);
+        _pcomm_leave( context, PCOMM_HIST_PREPARE, start );
+    }
+
+    if (context->exit_now) {
+        return result;
+    }
+
+    // populate write fds
+    max_fd = -1;
+    write_max = _pcomm_populate_set( &context->write_fds, &write_set );
+    max_fd = (write_max > max_fd) ? write_max : max_fd;
+
+    // do not process reads if we are trying to exit cleanly!
+    if (!context->exit_request) {
+        // populate read fds
+        read_max = _pcomm_populate_set( &context->read_fds, &read_set );
+        max_fd = (read_max > max_fd) ? read_max : max_fd;
+
+        // populate error fds
+        error_max = _pcomm_populate_set( &context->error_fds, &error_set );
+        max_fd = (error_max > max_fd) ? error_max : max_fd;
+    }
+    else {
+        read_max = -1;
+        error_max = -1;
+    }
+
+    // with no descriptors left, keep going only while timers or posted
+    // tasks are pending
+    timer_wait = _pcomm_timers_wait_ms( context );
+    if ( (max_fd < 0) && (timer_wait < 0) && !context->persistent &&
+         (context->signal_fd < 0) &&
+         !_pcomm_queue_pending(&context->tasks) && !context->offload.outstanding ) {
+        return PCOMM_FD_NOT_FOUND;
+    }
+
+    _pcomm_trace( context, PCOMM_TRACE_ITERATION, -1, max_fd );
+
+    // the wakeup descriptor is always watched, but never keeps the loop
+    // alive on its own
+    if ( read_max < 0 ) {
+        FD_ZERO( &read_set );
+    }
+    FD_SET( context->wake_fd, &read_set );
+    read_max = (context->wake_fd > read_max) ? context->wake_fd : read_max;
+    if ( context->signal_fd >= 0 ) {
+        FD_SET( context->signal_fd, &read_set );
+        read_max = (context->signal_fd > read_max) ? context->signal_fd : read_max;
+    }
+    max_fd = (read_max > max_fd) ? read_max : max_fd;
+
+    write_set_ptr = (write_max >= 0) ? &write_set : NULL;
+    read_set_ptr  = (read_max  >= 0) ? &read_set  : NULL;
+    error_set_ptr = (error_max >= 0) ? &error_set : NULL;
+
+    timeout.tv_sec = context->timeout.tv_sec;
+    timeout.tv_usec = context->timeout.tv_usec;
+
+    // in blocking mode a zero timeout means wait for as long as it takes
+    timeout_ptr = &timeout;
+    if ( context->blocking && !timerisset(&timeout) ) {
+        timeout_ptr = NULL;
+    }
+
+    // wake up in time for the nearest timer if it is due sooner
+    timer_timeout = 0;
+    if ( (timer_wait >= 0) &&
+         (!timeout_ptr ||
+          ((timer_wait * 1000) < ((int64_t)timeout.tv_sec * 1000000 + timeout.tv_usec))) ) {
+        timeout.tv_sec = timer_wait / 1000;
+        timeout.tv_usec = (timer_wait % 1000) * 1000;
+        timeout_ptr = &timeout;
+        timer_timeout = 1;
+    }
+
+    // a caller driving single passes may cap the wait further
+    if ( limit && (!timeout_ptr || timercmp(limit, timeout_ptr, <)) ) {
+        timeout = *limit;
+        timeout_ptr = &timeout;
+        timer_timeout = 1;
+    }
+
+    // stay awake with a zero timeout while busy polling pays off
+    spinning = 0;
+    if ( context->busy_poll_us && (!timeout_ptr || timerisset(timeout_ptr)) &&
+         _pcomm_busy_poll_spin(context, _pcomm_now_ns(context) / 1000ULL) ) {
+        timerclear( &timeout );
+        timeout_ptr = &timeout;
+        spinning = 1;
+    }
+
+    // Announce that we may sleep before the last look at the task queue;
+    // pcomm_post checks the flag after queueing, so one side always sees
+    // the other.
+    if ( !timeout_ptr || timerisset(timeout_ptr) ) {
+        __atomic_store_n( &context->sleeping, 1, __ATOMIC_SEQ_CST );
+        if ( _pcomm_queue_pending(&context->tasks) ) {
+            timerclear( &timeout );
+            timeout_ptr = &timeout;
+            timer_timeout = 1;
+        }
+    }
+
+    __atomic_store_n( &context->watchdog.busy_since, 0, __ATOMIC_RELAXED );
+    PCOMM_PROBE2( wait__start, context, max_fd );
+    start = _pcomm_hist_start( context );
+    num_fds = select( max_fd + 1, read_set_ptr, write_set_ptr, error_set_ptr, timeout_ptr );
+    _pcomm_hist_stop( context, PCOMM_HIST_WAIT, start );
+    PCOMM_PROBE2( wait__end, context, num_fds );
+    __atomic_store_n( &context->sleeping, 0, __ATOMIC_RELAXED );
+    _pcomm_update_clock( context );
+    _pcomm_watchdog_pass( context );
+    _pcomm_count_select( context, num_fds );
+    if ( context->busy_poll_us && (num_fds > 0) ) {
+        _pcomm_busy_poll_event( context, _pcomm_now_ns(context) / 1000ULL );
+    }
+
+    // wakeups are consumed here and are otherwise not events; signals
+    // go straight to their callbacks
+    if ( num_fds > 0 ) {
+        if ( FD_ISSET(context->wake_fd, read_set_ptr) ) {
+            _pcomm_drain_wakeup( context );
+            FD_CLR( context->wake_fd, read_set_ptr );
+            num_fds--;
+        }
+        if ( (context->signal_fd >= 0) && FD_ISSET(context->signal_fd, read_set_ptr) ) {
+            _pcomm_read_signals( context );
+            FD_CLR( context->signal_fd, read_set_ptr );
+            num_fds--;
+        }
+        woken = !num_fds;
+    }
+    if ( (num_fds < 0) && (errno == EINTR) ) {
+        // a signal with a handler interrupted select; just go round again
+        _pcomm_trace( context, PCOMM_TRACE_INTERRUPTED, -1, 0 );
+        return result;
+    }
+    if ( woken ) {
+        // only the internal descriptors were ready: nothing to dispatch,
+        // but timers that came due meanwhile still run below
+    } else if ( num_fds < 0 ) {
+        // before potentially resetting, check for exit
+        if (context->exit_now) {
+            return result;
+        }
+        context->exit_now = 1;
+        _pcomm_trace( context, PCOMM_TRACE_SELECT_ERROR, -1, errno );
+        switch (errno) {
+            case EBADF:
+                fprintf( stderr, "Bad file descriptor\n" );
+                break;
+            case EINVAL:
+                fprintf( stderr, "Invalid timeout or max fd\n" );
+                break;
+            case ENOMEM:
+                fprintf( stderr, "Out of memory\n" );
+                break;
+            default:
+                fprintf( stderr, "Unknown error with select\n" );
+                context->exit_now = 0;
+        }
+    } else if ( num_fds == 0 ) {
+        if (context->exit_now) {
+            return result;
+        }
+        // an empty poll hands the core to whoever is about to send to
+        // us if it shares this CPU; it costs nothing on an idle core
+        if (spinning) {
+            sched_yield();
+        }
+        _pcomm_trace( context, PCOMM_TRACE_TIMEOUT, -1, 0 );
+        if (context->timeout_callback && !timer_timeout && !spinning) {
+            start = _pcomm_enter( context, PCOMM_HIST_TIMEOUT, -1 );
+            context->timeout_callback(context);
+            _pcomm_leave( context, PCOMM_HIST_TIMEOUT, start );
+        }
+    } else {
+        // call the post select routine if supplied
+        _pcomm_trace( context, PCOMM_TRACE_WAKE, -1, num_fds );
+        if (context->select_callback) {
+            start = _pcomm_enter( context, PCOMM_HIST_SELECT, -1 );
+            context->select_callback(context);
+            _pcomm_leave( context, PCOMM_HIST_SELECT, start );
+        }
+        if (context->exit_now) {
+            return result;
+        }
+
+        // This order is intential.
+        _process_selected_fds(context, PCOMM_STREAM_ERROR, error_set_ptr);
+        _process_selected_fds(context, PCOMM_STREAM_WRITE, write_set_ptr);
+        _process_selected_fds(context, PCOMM_STREAM_READ,  read_set_ptr);
+    }
+
+    // timers and posted tasks are serviced on every pass, not only when
+    // select times out
+    if (!context->exit_now) {
+        _pcomm_timers_run( context );
+        _pcomm_run_tasks( context );
+    }
+
+    return result;
+}
+
+/* The real magic happens here */
+pcomm_result_t _pcomm_loop( pcomm_context_t *context ) {
+    pcomm_result_t result = PCOMM_SUCCESS;
+    uint64_t start;
+
+    if ( !context ) {
+        fprintf( stderr, "Context null!\n" );
+        return PCOMM_NULL_CONTEXT;
+    }
+
+    // callbacks run from here on share one clock sample per iteration
+    _pcomm_update_clock( context );
+    _pcomm_watchdog_attach( context );
+    context->looping = 1;
+
+    while (!context->exit_now)
+ // PCOMM LOOP
+    {
+        PCOMM_PROBE1( iteration__start, context );
+        start = _pcomm_hist_start( context );
+        if ( (result = _pcomm_iterate( context, NULL )) == PCOMM_FD_NOT_FOUND ) {
+            context->exit_now = 1;
+        }
+        _pcomm_hist_stop( context, PCOMM_HIST_ITERATION, start );
+        PCOMM_PROBE2( iteration__end, context, (int)result );
+ // PCOMM LOOP
+    }
+    context->looping = 0;
+    _pcomm_watchdog_detach( context );
+
+    return result;
+}
+
+/* Mirror the descriptors the next pass would select on into the backend
+ * epoll set, arm its timer for the nearest deadline and announce that the
+ * loop is idle, so posts from other threads wake the host through wake_fd.
+ */
+void _pcomm_backend_sync( pcomm_context_t *context )
+{
+    struct itimerspec due;
+    struct epoll_event event;
+    fd_set read_set;
+    fd_set write_set;
+    fd_set error_set;
+    int64_t timer_wait;
+    uint32_t wanted;
+    int fd;
+
+    _pcomm_populate_set( &context->write_fds, &write_set );
+    if (!context->exit_request) {
+        _pcomm_populate_set( &context->read_fds,  &read_set );
+        _pcomm_populate_set( &context->error_fds, &error_set );
+    } else {
+        FD_ZERO( &read_set );
+        FD_ZERO( &error_set );
+    }
+    FD_SET( context->wake_fd, &read_set );
+    FD_SET( context->backend_timer_fd, &read_set );
+    if ( context->signal_fd >= 0 ) {
+        FD_SET( context->signal_fd, &read_set );
+    }
 
-        if ( max_fd < 0 ) {
-            result = PCOMM_FD_NOT_FOUND;
-            context->exit_now = 1;
+    // only descriptors whose interest changed cost an epoll_ctl
+    for ( fd = 0; fd < FD_SETSIZE; fd++ ) {
+        wanted = (FD_ISSET(fd, &read_set)  ? EPOLLIN  : 0) |
+                 (FD_ISSET(fd, &write_set) ? EPOLLOUT : 0) |
+                 (FD_ISSET(fd, &error_set) ? EPOLLPRI : 0);
+        if ( wanted == context->backend_events[fd] ) {
             continue;
         }
+        memset( &event, 0, sizeof(event) );
+        event.events = wanted;
+        event.data.fd = fd;
+        // epoll drops descriptors on close, so a number we still think is
+        // registered may have been reused
+        if ( !wanted ) {
+            epoll_ctl( context->backend_fd, EPOLL_CTL_DEL, fd, NULL );
+        } else if ( epoll_ctl( context->backend_fd,
+                               context->backend_events[fd] ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                               fd, &event ) ) {
+            epoll_ctl( context->backend_fd,
+                       (errno == ENOENT) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &event );
+        }
+        context->backend_events[fd] = wanted;
+    }
+
+    // a zero it_value disarms, so a timer that is already due gets 1ns
+    memset( &due, 0, sizeof(due) );
+    if ( (timer_wait = _pcomm_timers_wait_ms( context )) >= 0 ) {
+        due.it_value.tv_sec = timer_wait / 1000;
+        due.it_value.tv_nsec = (timer_wait % 1000) * 1000000L;
+        if ( !timer_wait ) {
+            due.it_value.tv_nsec = 1;
+        }
+    }
+    timerfd_settime( context->backend_timer_fd, 0, &due, NULL );
+
+    // same handshake as a loop about to block in select
+    __atomic_store_n( &context->sleeping, 1, __ATOMIC_SEQ_CST );
+    if ( _pcomm_queue_pending(&context->tasks) ) {
+        pcomm_wakeup( context );
+    }
+}
+
+void _pcomm_backend_free( pcomm_context_t *context )
+{
+    if ( context->backend_fd >= 0 ) {
+        close( context->backend_fd );
+        context->backend_fd = -1;
+    }
+    if ( context->backend_timer_fd >= 0 ) {
+        close( context->backend_timer_fd );
+        context->backend_timer_fd = -1;
+    }
+    free( context->backend_events );
+    context->backend_events = NULL;
+}
+
+pcomm_result_t pcomm_init( pcomm_context_t *context )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+
+    if ( !context ) {
+        result = PCOMM_NULL_CONTEXT;
+    }
+    else if ( list_init( &context->read_fds  ) || 
+              list_init( &context->write_fds ) || 
+              list_init( &context->error_fds ) ) {
+        result = PCOMM_INIT_FAILED;
+    } else if ( (context->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ) {
+        result = PCOMM_INIT_FAILED;
+    } else {
+        list_attributes_seeker( &context->read_fds,  _list_aid_seeker );
+        list_attributes_seeker( &context->write_fds, _list_aid_seeker );
+        list_attributes_seeker( &context->error_fds, _list_aid_seeker );
+        list_attributes_comparator( &context->read_fds,  _list_aid_comparator );
+        list_attributes_comparator( &context->write_fds, _list_aid_comparator );
+        list_attributes_comparator( &context->error_fds, _list_aid_comparator );
+        context->page_size = PCOMM_PAGE_SIZE;
+        context->prepare_callback = NULL;
+        context->select_callback = NULL;
+        context->timeout_callback = NULL;
+        context->timeout.tv_sec = 0;
+        context->timeout.tv_usec = 0;
+        context->blocking = 0;
+        context->wake_pending = 0;
+        context->sleeping = 0;
+        context->persistent = 0;
+        context->busy_poll_us = 0;
+        context->busy_poll_gap_us = 0;
+        context->last_event_us = 0;
+        context->coarse_clock = 0;
+        context->looping = 0;
+        context->signal_fd = -1;
+        context->backend_fd = -1;
+        context->backend_timer_fd = -1;
+        context->backend_events = NULL;
+        context->dispatching = 0;
+        context->retired = NULL;
+        memset( &context->stats, 0, sizeof(context->stats) );
+        context->stats.since = _pcomm_now_ns( context );
+        context->histograms = NULL;
+        memset( &context->watchdog, 0, sizeof(context->watchdog) );
+        memset( &context->trace, 0, sizeof(context->trace) );
+        sigemptyset( &context->signals );
+        sigemptyset( &context->signals_blocked );
+        memset( context->signal_callbacks, 0, sizeof(context->signal_callbacks) );
+        _pcomm_queue_init( &context->tasks );
+        memset( &context->offload, 0, sizeof(context->offload) );
+        memset( &context->timers, 0, sizeof(context->timers) );
+        context->timers.current = _pcomm_now_ms( context );
+        context->initialized = 1;
+        context->debug = 0;
+        context->exit_request = 0;
+        context->exit_now = 0;
+        context->external_context = NULL;
+    }
+
+    return result;
+}
+
+void pcomm_set_debug( pcomm_context_t *context, int debug )
+{
+    if (context) {
+        context->debug = (debug == 0) ? 0 : 1;
+        if ( context->debug && context->initialized && !context->trace.records ) {
+            pcomm_set_trace( context, PCOMM_TRACE_DEFAULT );
+        }
+    }
+}
+
+int pcomm_get_debug( pcomm_context_t *context )
+{
+    if (context) {
+        return context->debug;
+    }
+    return 0;
+}
+
+pcomm_result_t pcomm_destroy( pcomm_context_t *context )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+
+    if (!context) {
+        result = PCOMM_NULL_CONTEXT;
+    } else {
+        if (context->initialized) {
+            // workers may still be posting completions, stop them first
+            _pcomm_watchdog_stop( context );
+            _pcomm_pool_stop( context );
+            context->initialized = 0;
+            context->external_context = NULL;
+            _pcomm_empty_list( context, &context->read_fds );
+            _pcomm_empty_list( context, &context->write_fds );
+            _pcomm_empty_list( context, &context->error_fds );
+            list_destroy( &context->read_fds );
+            list_destroy( &context->write_fds );
+            list_destroy( &context->error_fds );
+            _pcomm_timers_free( &context->timers );
+            _pcomm_free_tasks( context );
+            if ( context->wake_fd >= 0 ) {
+                close( context->wake_fd );
+                context->wake_fd = -1;
+            }
+            if ( context->signal_fd >= 0 ) {
+                close( context->signal_fd );
+                context->signal_fd = -1;
+                pthread_sigmask( SIG_UNBLOCK, &context->signals_blocked, NULL );
+            }
+            _pcomm_backend_free( context );
+            free( context->histograms );
+            context->histograms = NULL;
+            free( context->trace.records );
+            memset( &context->trace, 0, sizeof(context->trace) );
+        }
+    }
+    return result;
+}
+
+pcomm_result_t pcomm_main( pcomm_context_t *context ) 
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+
+    if (!context) {
+        result = PCOMM_NULL_CONTEXT;
+    } else if (!context->initialized) {
+        result = PCOMM_UNINITIALIZED_CONTEXT;
+    } else if (context->exit_request || context->exit_now) {
+        result = PCOMM_EXITING;
+    } else {
+        result = _pcomm_loop( context );
+    }
+
+    return result;
+}
+
+pcomm_result_t pcomm_stop( pcomm_context_t *context, int immediately ) 
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+
+    if (!context) {
+        result = PCOMM_NULL_CONTEXT;
+    } else {
+        context->exit_request = 1;
+        if ( immediately ) {
+            context->exit_now = 1;
+        }
+        // may be called from another thread while the loop is in select
+        if ( context->initialized ) {
+            pcomm_wakeup( context );
+        }
+    }
+
+    return result;
+}
+
+pcomm_result_t pcomm_run_once( pcomm_context_t *context, int timeout_ms )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+    struct timeval limit;
+    uint64_t expirations;
+    uint64_t start;
+
+    if (!context) {
+        result = PCOMM_NULL_CONTEXT;
+    } else if (!context->initialized) {
+        result = PCOMM_UNINITIALIZED_CONTEXT;
+    } else if (context->exit_now) {
+        result = PCOMM_EXITING;
+    } else {
+        limit.tv_sec = timeout_ms / 1000;
+        limit.tv_usec = (timeout_ms % 1000) * 1000;
+        if ( context->backend_timer_fd >= 0 ) {
+            // the pass below runs whatever timer made this readable
+            read( context->backend_timer_fd, &expirations, sizeof(expirations) );
+        }
+
+        _pcomm_update_clock( context );
+        _pcomm_watchdog_attach( context );
+        context->looping = 1;
+        PCOMM_PROBE1( iteration__start, context );
+        start = _pcomm_hist_start( context );
+        result = _pcomm_iterate( context, (timeout_ms < 0) ? NULL : &limit );
+        _pcomm_hist_stop( context, PCOMM_HIST_ITERATION, start );
+        PCOMM_PROBE2( iteration__end, context, (int)result );
+        context->looping = 0;
+        _pcomm_watchdog_detach( context );
+
+        if (context->exit_now) {
+            result = PCOMM_EXITING;
+        } else if ( context->backend_fd >= 0 ) {
+            _pcomm_backend_sync( context );
+        }
+    }
+
+    return result;
+}
+
+int pcomm_get_backend_fd( pcomm_context_t *context )
+{
+    if ( !context || !context->initialized ) {
+        return -1;
+    }
+    if ( context->backend_fd < 0 ) {
+        if ( ((context->backend_fd = epoll_create1( EPOLL_CLOEXEC )) < 0) ||
+             ((context->backend_timer_fd = timerfd_create( CLOCK_MONOTONIC,
+                                           TFD_NONBLOCK | TFD_CLOEXEC )) < 0) ||
+             !(context->backend_events = calloc( sizeof(uint32_t), FD_SETSIZE )) ) {
+            _pcomm_backend_free( context );
+            return -1;
+        }
+    }
+    _pcomm_backend_sync( context );
+
+    return context->backend_fd;
+}
+
+pcomm_result_t pcomm_set_blocking( pcomm_context_t *context, int blocking )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+
+    if (!context) {
+        result = PCOMM_NULL_CONTEXT;
+    } else if (!context->initialized) {
+        result = PCOMM_UNINITIALIZED_CONTEXT;
+    } else {
+        context->blocking = (blocking == 0) ? 0 : 1;
+    }
+
+    return result;
+}
+
+int pcomm_get_blocking( pcomm_context_t *context )
+{
+    if (context) {
+        return context->blocking;
+    }
+    return 0;
+}
+
+uint64_t pcomm_now( pcomm_context_t *context )
+{
+    if (context) {
+        return _pcomm_now_ns( context );
+    }
+    return 0;
+}
+
+pcomm_result_t pcomm_set_coarse_clock( pcomm_context_t *context, int coarse )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+
+    if (!context) {
+        result = PCOMM_NULL_CONTEXT;
+    } else if (!context->initialized) {
+        result = PCOMM_UNINITIALIZED_CONTEXT;
+    } else {
+        context->coarse_clock = (coarse == 0) ? 0 : 1;
+        _pcomm_update_clock( context );
+    }
+
+    return result;
+}
+
+int pcomm_get_coarse_clock( pcomm_context_t *context )
+{
+    if (context) {
+        return context->coarse_clock;
+    }
+    return 0;
+}
+
+pcomm_result_t pcomm_set_busy_poll( pcomm_context_t *context, uint64_t max_spin_us )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+
+    if (!context) {
+        result = PCOMM_NULL_CONTEXT;
+    } else if (!context->initialized) {
+        result = PCOMM_UNINITIALIZED_CONTEXT;
+    } else {
+        context->busy_poll_us = max_spin_us;
+        // start out assuming busy traffic so the first events are spun for
+        context->busy_poll_gap_us = max_spin_us / 2;
+        context->last_event_us = _pcomm_now_ns(context) / 1000ULL;
+    }
+
+    return result;
+}
+
+uint64_t pcomm_get_busy_poll( pcomm_context_t *context )
+{
+    if (context) {
+        return context->busy_poll_us;
+    }
+    return 0;
+}
+
+pcomm_result_t pcomm_wakeup( pcomm_context_t *context )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+    uint64_t one = 1;
+
+    if (!context) {
+        result = PCOMM_NULL_CONTEXT;
+    } else if (!context->initialized) {
+        result = PCOMM_UNINITIALIZED_CONTEXT;
+    } else if (context->wake_fd < 0) {
+        result = PCOMM_FD_NOT_FOUND;
+    } else if ( __atomic_exchange_n(&context->wake_pending, 1, __ATOMIC_SEQ_CST) ) {
+        // the loop has not consumed the previous wakeup yet, one is enough
+    } else if ( write(context->wake_fd, &one, sizeof(one)) != sizeof(one) ) {
+        // EAGAIN means the counter is saturated and a wakeup is already due
+        if ( errno != EAGAIN ) {
+            result = PCOMM_FD_WRITE_FAILED;
+        }
+    }
+
+    return result;
+}
+
+pcomm_result_t pcomm_post( pcomm_context_t *context, pcomm_callback_task callback, void *arg )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+    pcomm_task_t *task = NULL;
+
+    if (!context) {
+        result = PCOMM_NULL_CONTEXT;
+    } else if (!context->initialized) {
+        result = PCOMM_UNINITIALIZED_CONTEXT;
+    } else if (context->exit_request) {
+        result = PCOMM_EXITING;
+    } else if (!callback) {
+        result = PCOMM_NULL_CALLBACK;
+    } else if ( !(task = malloc(sizeof(pcomm_task_t))) ) {
+        result = PCOMM_OUT_OF_MEMORY;
+    } else {
+        task->callback = callback;
+        task->arg = arg;
+        result = _pcomm_enqueue( context, task );
+    }
+
+    return result;
+}
+
+pcomm_result_t pcomm_set_offload_threads( pcomm_context_t *context, size_t threads )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
 
-        if (context->debug) {
-            fprintf( stderr, "pcomm: max_fd = %d\n", max_fd );
-            fprintf( stderr, "pcomm:   write_fd = %d\n", write_max );
-            fprintf( stderr, "pcomm:   read_fd  = %d\n", read_max );
-            fprintf( stderr, "pcomm:   error_fd = %d\n", error_max );
+    if (!context) {
+        result = PCOMM_NULL_CONTEXT;
+    } else if (!context->initialized) {
+        result = PCOMM_UNINITIALIZED_CONTEXT;
+    } else {
+        // resizing drains the old workers first
+        _pcomm_pool_stop( context );
+        if (threads) {
+            result = _pcomm_pool_start( context, threads );
         }
+    }
 
-        write_set_ptr = (write_max >= 0) ? &write_set : NULL;
-        read_set_ptr  = (read_max  >= 0) ? &read_set  : NULL;
-        error_set_ptr = (error_max >= 0) ? &error_set : NULL;
+    return result;
+}
 
-        timeout.tv_sec = context->timeout.tv_sec;
-        timeout.tv_usec = context->timeout.tv_usec;
+pcomm_result_t pcomm_offload( pcomm_context_t *context, pcomm_callback_job job_callback,
+                              pcomm_callback_task done_callback, void *arg )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+    struct PCOMM_POOL *pool = NULL;
+    struct PCOMM_JOB *job = NULL;
+    long cpus;
 
-        num_fds = select( max_fd + 1, read_set_ptr, write_set_ptr, error_set_ptr, &timeout );
-        if ( num_fds < 0 ) {
-            // before potentially resetting, check for exit
-            if (context->exit_now) {
-                continue;
-            }
-            context->exit_now = 1;
-            switch (errno) {
-                case EBADF:
-                    fprintf( stderr, "Bad file descriptor\n" );
-                    break;
-                case EINTR:
-                    fprintf( stderr, "Caught interrupt signal\n" );
-                    break;
-                case EINVAL:
-                    fprintf( stderr, "Invalid timeout or max fd\n" );
-                    break;
-                case ENOMEM:
-                    fprintf( stderr, "Out of memory\n" );
-                    break;
-                default:
-                    fprintf( stderr, "Unknown error with select\n" );
-                    context->exit_now = 0;
-            }
-        } else if ( num_fds == 0 ) {
-            if (context->exit_now) {
-                continue;
-            }
-            if (context->debug) {
-                fprintf( stderr, "pcomm: timeout occurred (no descriptor selected)\n" );
-            }
-            else if (context->timeout_callback) {
-                context->timeout_callback(context);
-            }
+    if (!context) {
+        result = PCOMM_NULL_CONTEXT;
+    } else if (!context->initialized) {
+        result = PCOMM_UNINITIALIZED_CONTEXT;
+    } else if (context->exit_request) {
+        result = PCOMM_EXITING;
+    } else if (!job_callback) {
+        result = PCOMM_NULL_JOB;
+    } else {
+        pool = &context->offload;
+        // start one worker per online CPU on first use
+        if ( !pool->threads ) {
+            cpus = sysconf( _SC_NPROCESSORS_ONLN );
+            result = _pcomm_pool_start( context, (cpus > 0) ? (size_t)cpus : 1 );
+        }
+        if ( result != PCOMM_SUCCESS ) {
+            // nothing to queue on
+        } else if ( !(job = calloc( sizeof(struct PCOMM_JOB), 1 )) ) {
+            result = PCOMM_OUT_OF_MEMORY;
         } else {
-            // call the post select routine if supplied
-            if (context->select_callback) {
-                if (context->debug) {
-                    fprintf( stderr, "pcomm: calling select routine\n" );
+            job->context = context;
+            job->job_callback = job_callback;
+            job->done_callback = done_callback;
+            job->arg = arg;
+            // counted before a worker can take it, so the count never wraps
+            __atomic_add_fetch( &pool->queued, 1, __ATOMIC_SEQ_CST );
+            if ( (result = _pcomm_deque_push( &pool->deques[pool->next++ % pool->size],
+                                              job )) != PCOMM_SUCCESS ) {
+                __atomic_sub_fetch( &pool->queued, 1, __ATOMIC_SEQ_CST );
+                free( job );
+            } else {
+                pool->outstanding++;
+                if ( __atomic_load_n( &pool->idle, __ATOMIC_SEQ_CST ) ) {
+                    pthread_mutex_lock( &pool->lock );
+                    pthread_cond_signal( &pool->ready );
+                    pthread_mutex_unlock( &pool->lock );
                 }
-                context->select_callback(context);
-            }
-            if (context->exit_now) {
-                continue;
             }
-
-            if (context->debug) {
-                fprintf( stderr, "pcomm: processing file descriptors\n" );
-            }
-            // This order is intential.
-            _process_selected_fds(context, PCOMM_STREAM_ERROR, error_set_ptr);
-            _process_selected_fds(context, PCOMM_STREAM_WRITE, write_set_ptr);
-            _process_selected_fds(context, PCOMM_STREAM_READ,  read_set_ptr);
         }
- // PCOMM LOOP
     }
 
     return result;
 }
 
-pcomm_result_t pcomm_init( pcomm_context_t *context )
+pcomm_result_t pcomm_get_stats( pcomm_context_t *context, pcomm_stats_t *stats )
 {
     pcomm_result_t result = PCOMM_SUCCESS;
 
-    if ( !context ) {
+    if (!context) {
         result = PCOMM_NULL_CONTEXT;
+    } else if (!context->initialized) {
+        result = PCOMM_UNINITIALIZED_CONTEXT;
+    } else if (!stats) {
+        result = PCOMM_NULL_BUFFER;
+    } else {
+        *stats = context->stats;
     }
-    else if ( list_init( &context->read_fds  ) || 
-              list_init( &context->write_fds ) || 
-              list_init( &context->error_fds ) ) {
-        result = PCOMM_INIT_FAILED;
+
+    return result;
+}
+
+pcomm_result_t pcomm_reset_stats( pcomm_context_t *context )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+
+    if (!context) {
+        result = PCOMM_NULL_CONTEXT;
+    } else if (!context->initialized) {
+        result = PCOMM_UNINITIALIZED_CONTEXT;
     } else {
-        list_attributes_seeker( &context->read_fds,  _list_aid_seeker );
-        list_attributes_seeker( &context->write_fds, _list_aid_seeker );
-        list_attributes_seeker( &context->error_fds, _list_aid_seeker );
-        list_attributes_comparator( &context->read_fds,  _list_aid_comparator );
-        list_attributes_comparator( &context->write_fds, _list_aid_comparator );
-        list_attributes_comparator( &context->error_fds, _list_aid_comparator );
-        context->page_size = PCOMM_PAGE_SIZE;
-        context->prepare_callback = NULL;
-        context->select_callback = NULL;
-        context->timeout_callback = NULL;
-        context->timeout.tv_sec = 0;
-        context->timeout.tv_usec = 0;
-        context->initialized = 1;
-        context->debug = 0;
-        context->exit_request = 0;
-        context->exit_now = 0;
-        context->external_context = NULL;
+        memset( &context->stats, 0, sizeof(context->stats) );
+        context->stats.since = _pcomm_now_ns( context );
     }
 
     return result;
 }
 
-void pcomm_set_debug( pcomm_context_t *context, int debug )
+void pcomm_histogram_record( pcomm_histogram_t *histogram, uint64_t value )
 {
-    if (context) {
-        context->debug = (debug == 0) ? 0 : 1;
+    int exponent;
+    size_t index;
+
+    if (!histogram) {
+        return;
+    }
+    if ( value < PCOMM_HIST_SUB_BUCKETS ) {
+        index = (size_t)value;
+    } else {
+        // the bits just below the leading one pick the linear bucket within
+        // the value's power of two
+        exponent = 63 - __builtin_clzll( value );
+        index = (size_t)(exponent - PCOMM_HIST_SUB_BITS + 1) * PCOMM_HIST_SUB_BUCKETS +
+                (size_t)((value >> (exponent - PCOMM_HIST_SUB_BITS)) & (PCOMM_HIST_SUB_BUCKETS - 1));
+        if ( index >= PCOMM_HIST_BUCKETS ) {
+            index = PCOMM_HIST_BUCKETS - 1;
+        }
+    }
+    histogram->buckets[index]++;
+    if ( !histogram->count || (value < histogram->min) ) {
+        histogram->min = value;
+    }
+    if ( value > histogram->max ) {
+        histogram->max = value;
     }
+    histogram->count++;
+    histogram->sum += value;
 }
 
-int pcomm_get_debug( pcomm_context_t *context )
+uint64_t pcomm_histogram_percentile( const pcomm_histogram_t *histogram, double percentile )
 {
-    if (context) {
-        return context->debug;
+    uint64_t rank;
+    uint64_t seen = 0;
+    uint64_t top;
+    size_t index;
+    int exponent;
+
+    if ( !histogram || !histogram->count ) {
+        return 0;
     }
-    return 0;
+    if ( percentile <= 0.0 ) {
+        return histogram->min;
+    }
+    rank = (uint64_t)((percentile / 100.0) * (double)histogram->count + 0.5);
+    if ( rank < 1 ) {
+        rank = 1;
+    }
+    for ( index = 0; index < PCOMM_HIST_BUCKETS - 1; index++ ) {
+        if ( (seen += histogram->buckets[index]) >= rank ) {
+            break;
+        }
+    }
+    if ( index < PCOMM_HIST_SUB_BUCKETS ) {
+        top = (uint64_t)index;
+    } else if ( index >= PCOMM_HIST_BUCKETS - 1 ) {
+        top = histogram->max;
+    } else {
+        exponent = (int)(index / PCOMM_HIST_SUB_BUCKETS) + PCOMM_HIST_SUB_BITS - 1;
+        top = ((uint64_t)(PCOMM_HIST_SUB_BUCKETS + (index % PCOMM_HIST_SUB_BUCKETS) + 1)
+               << (exponent - PCOMM_HIST_SUB_BITS)) - 1;
+    }
+
+    return (top < histogram->max) ? top : histogram->max;
 }
 
-pcomm_result_t pcomm_destroy( pcomm_context_t *context )
+pcomm_result_t pcomm_set_histograms( pcomm_context_t *context, int enabled )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+
+    if (!context) {
+        result = PCOMM_NULL_CONTEXT;
+    } else if (!context->initialized) {
+        result = PCOMM_UNINITIALIZED_CONTEXT;
+    } else if (!enabled) {
+        free( context->histograms );
+        context->histograms = NULL;
+    } else if ( !context->histograms &&
+                !(context->histograms = calloc( sizeof(pcomm_histogram_t), PCOMM_HIST_COUNT )) ) {
+        result = PCOMM_OUT_OF_MEMORY;
+    }
+
+    return result;
+}
+
+pcomm_result_t pcomm_get_histogram( pcomm_context_t *context, pcomm_hist_t which,
+                                    pcomm_histogram_t *histogram )
 {
     pcomm_result_t result = PCOMM_SUCCESS;
 
     if (!context) {
         result = PCOMM_NULL_CONTEXT;
+    } else if (!context->initialized) {
+        result = PCOMM_UNINITIALIZED_CONTEXT;
+    } else if (!histogram) {
+        result = PCOMM_NULL_BUFFER;
+    } else if ( ((int)which < 0) || (which >= PCOMM_HIST_COUNT) ) {
+        result = PCOMM_INVALID_HISTOGRAM;
+    } else if (!context->histograms) {
+        memset( histogram, 0, sizeof(pcomm_histogram_t) );
     } else {
-        if (context->initialized) {
-            context->initialized = 0;
-            context->external_context = NULL;
-            _pcomm_empty_list( &context->read_fds );
-            _pcomm_empty_list( &context->write_fds );
-            _pcomm_empty_list( &context->error_fds );
-            list_destroy( &context->read_fds );
-            list_destroy( &context->write_fds );
-            list_destroy( &context->error_fds );
+        *histogram = context->histograms[which];
+    }
+
+    return result;
+}
+
+pcomm_result_t pcomm_reset_histograms( pcomm_context_t *context )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+
+    if (!context) {
+        result = PCOMM_NULL_CONTEXT;
+    } else if (!context->initialized) {
+        result = PCOMM_UNINITIALIZED_CONTEXT;
+    } else if (context->histograms) {
+        memset( context->histograms, 0, sizeof(pcomm_histogram_t) * PCOMM_HIST_COUNT );
+    }
+
+    return result;
+}
+
+pcomm_result_t pcomm_set_trace( pcomm_context_t *context, size_t records )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+    pcomm_trace_record_t *ring = NULL;
+    size_t capacity = 1;
+
+    if (!context) {
+        result = PCOMM_NULL_CONTEXT;
+    } else if (!context->initialized) {
+        result = PCOMM_UNINITIALIZED_CONTEXT;
+    } else {
+        while ( records && (capacity < records) ) {
+            capacity <<= 1;
+        }
+        if ( records && !(ring = calloc( capacity, sizeof(pcomm_trace_record_t) )) ) {
+            result = PCOMM_OUT_OF_MEMORY;
+        } else {
+            free( context->trace.records );
+            context->trace.records = ring;
+            context->trace.mask = ring ? (capacity - 1) : 0;
+            __atomic_store_n( &context->trace.head, 0, __ATOMIC_RELEASE );
         }
     }
+
     return result;
 }
 
-pcomm_result_t pcomm_main( pcomm_context_t *context ) 
+size_t pcomm_trace_dump( pcomm_context_t *context, pcomm_trace_record_t *records, size_t n )
+{
+    struct PCOMM_TRACE *trace;
+    uint64_t head;
+    uint64_t after;
+    uint64_t first;
+    uint64_t i;
+
+    if ( !context || !context->initialized || !records || !context->trace.records ) {
+        return 0;
+    }
+    trace = &context->trace;
+
+    head = __atomic_load_n( &trace->head, __ATOMIC_ACQUIRE );
+    first = (head > (trace->mask + 1)) ? (head - (trace->mask + 1)) : 0;
+    if ( (head - first) > n ) {
+        first = head - n;
+    }
+    for ( i = first; i < head; i++ ) {
+        records[i - first] = trace->records[i & trace->mask];
+    }
+
+    // anything the loop lapped while we copied is stale; drop it from the
+    // front. The writer fills slot head & mask before publishing head + 1,
+    // so the oldest slot of a full ring may be mid-write too.
+    __atomic_thread_fence( __ATOMIC_ACQUIRE );
+    after = __atomic_load_n( &trace->head, __ATOMIC_ACQUIRE );
+    if ( (after - first) >= (trace->mask + 1) ) {
+        i = after - trace->mask - first;
+        if ( i >= (head - first) ) {
+            return 0;
+        }
+        memmove( records, records + i, (head - first - i) * sizeof(pcomm_trace_record_t) );
+        first += i;
+    }
+
+    return (size_t)(head - first);
+}
+
+pcomm_result_t pcomm_trace_write( pcomm_context_t *context, int fd )
 {
     pcomm_result_t result = PCOMM_SUCCESS;
+    pcomm_trace_header_t header;
+    pcomm_trace_record_t *records = NULL;
+    size_t length;
 
     if (!context) {
         result = PCOMM_NULL_CONTEXT;
     } else if (!context->initialized) {
         result = PCOMM_UNINITIALIZED_CONTEXT;
-    } else if (context->exit_request || context->exit_now) {
-        result = PCOMM_EXITING;
+    } else if (!context->trace.records) {
+        result = PCOMM_NULL_BUFFER;
+    } else if ( !(records = malloc( (context->trace.mask + 1) * sizeof(pcomm_trace_record_t) )) ) {
+        result = PCOMM_OUT_OF_MEMORY;
     } else {
-        result = _pcomm_loop( context );
+        header.magic = PCOMM_TRACE_MAGIC;
+        header.version = PCOMM_TRACE_VERSION;
+        header.record_size = sizeof(pcomm_trace_record_t);
+        header.count = (uint32_t)pcomm_trace_dump( context, records, context->trace.mask + 1 );
+        length = header.count * sizeof(pcomm_trace_record_t);
+        if ( (write( fd, &header, sizeof(header) ) != sizeof(header)) ||
+             (write( fd, records, length ) != (ssize_t)length) ) {
+            result = PCOMM_FD_WRITE_FAILED;
+        }
     }
+    free( records );
 
     return result;
 }
 
-pcomm_result_t pcomm_stop( pcomm_context_t *context, int immediately ) 
+const char *pcomm_trace_name( pcomm_trace_event_t event )
+{
+    switch (event) {
+        case PCOMM_TRACE_ITERATION:
+            return "iteration";
+        case PCOMM_TRACE_WAKE:
+            return "wake";
+        case PCOMM_TRACE_TIMEOUT:
+            return "timeout";
+        case PCOMM_TRACE_INTERRUPTED:
+            return "interrupted";
+        case PCOMM_TRACE_SELECT_ERROR:
+            return "select-error";
+        case PCOMM_TRACE_READY:
+            return "ready";
+        case PCOMM_TRACE_READ:
+            return "read";
+        case PCOMM_TRACE_WRITE:
+            return "write";
+        case PCOMM_TRACE_IO_FAILED:
+            return "io-failed";
+        case PCOMM_TRACE_EXPIRED:
+            return "expired";
+        case PCOMM_TRACE_CLOSE:
+            return "close";
+        case PCOMM_TRACE_CALLBACK:
+            return "callback";
+        default:
+            return "unknown";
+    }
+}
+
+pcomm_result_t pcomm_set_watchdog( pcomm_context_t *context, uint64_t threshold_ms,
+                                   pcomm_callback_stall stall_callback )
 {
     pcomm_result_t result = PCOMM_SUCCESS;
 
     if (!context) {
         result = PCOMM_NULL_CONTEXT;
+    } else if (!context->initialized) {
+        result = PCOMM_UNINITIALIZED_CONTEXT;
     } else {
-        context->exit_request = 1;
-        if ( immediately ) {
-            context->exit_now = 1;
+        // changing the threshold restarts the thread with the new settings
+        _pcomm_watchdog_stop( context );
+        if (threshold_ms) {
+            result = _pcomm_watchdog_start( context, threshold_ms, stall_callback );
         }
     }
 
     return result;
 }
 
+pcomm_result_t pcomm_set_persistent( pcomm_context_t *context, int persistent )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+
+    if (!context) {
+        result = PCOMM_NULL_CONTEXT;
+    } else if (!context->initialized) {
+        result = PCOMM_UNINITIALIZED_CONTEXT;
+    } else {
+        context->persistent = (persistent == 0) ? 0 : 1;
+    }
+
+    return result;
+}
+
 pcomm_result_t pcomm_set_external_context( pcomm_context_t *context, void *external_context ) {
     pcomm_result_t result = PCOMM_SUCCESS;
 
@@ -816,32 +2891,174 @@ pcomm_result_t pcomm_set_external_fd_context( pcomm_context_t *context, pcomm_st
     return result;
 }
 
-void *pcomm_get_external_fd_context( pcomm_context_t *context, pcomm_stream_t type, int fd ) {
-    void *external_fd_context = NULL;
-    list_t *list = NULL;
-    pcomm_fd_t *fd_context = NULL;
+void *pcomm_get_external_fd_context( pcomm_context_t *context, pcomm_stream_t type, int fd ) {
+    void *external_fd_context = NULL;
+    list_t *list = NULL;
+    pcomm_fd_t *fd_context = NULL;
+
+    if (context && context->initialized) {
+        switch(type) {
+            case PCOMM_STREAM_WRITE:
+                list = &context->write_fds;
+                break;
+            case PCOMM_STREAM_READ:
+                list = &context->read_fds;
+                break;
+            case PCOMM_STREAM_ERROR:
+                list = &context->error_fds;
+                break;
+        }
+        
+        if (list && (fd >= 0) && (fd_context = _pcomm_get_fd(list, fd))) {
+            external_fd_context = fd_context->external_context;
+        }
+    }
+    return external_fd_context;
+}
+
+pcomm_result_t pcomm_set_page_size( pcomm_context_t *context, size_t page_size )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+
+    if (!context) {
+        result = PCOMM_NULL_CONTEXT;
+    } else if (!context->initialized) {
+        result = PCOMM_UNINITIALIZED_CONTEXT;
+    } else {
+        context->page_size = page_size;
+    }
+
+    return result;
+}
+
+pcomm_result_t pcomm_set_timeout( pcomm_context_t *context, struct timeval *timeout )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+
+    if (!context) {
+        result = PCOMM_NULL_CONTEXT;
+    } else if (!context->initialized) {
+        result = PCOMM_UNINITIALIZED_CONTEXT;
+    } else {
+        context->timeout.tv_sec = timeout->tv_sec;
+        context->timeout.tv_usec = timeout->tv_usec;
+    }
+
+    return result;
+}
+
+pcomm_result_t pcomm_set_timeout_callback( pcomm_context_t *context, 
+                                           pcomm_callback_routine timeout_callback )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+
+    if (!context) {
+        result = PCOMM_NULL_CONTEXT;
+    } else if (!context->initialized) {
+        result = PCOMM_UNINITIALIZED_CONTEXT;
+    } else {
+        context->timeout_callback = timeout_callback;
+    }
+
+    return result;
+}
+
+pcomm_result_t pcomm_get_fd_stats( pcomm_context_t *context, pcomm_stream_t type,
+                                   int fd, pcomm_fd_stats_t *stats )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+    pcomm_fd_t *fd_context = NULL;
+    list_t *list = NULL;
+
+    if (!context) {
+        result = PCOMM_NULL_CONTEXT;
+    } else if (!context->initialized) {
+        result = PCOMM_UNINITIALIZED_CONTEXT;
+    } else if (!stats) {
+        result = PCOMM_NULL_BUFFER;
+    } else if ( !(list = _pcomm_stream_list(context, type)) ) {
+        result = PCOMM_INVALID_STREAM_TYPE;
+    } else if ( fd < 0 ) {
+        result = PCOMM_FD_NEGATIVE;
+    } else if ( !(fd_context = _pcomm_get_fd(list, fd)) ) {
+        result = PCOMM_FD_NOT_FOUND;
+    } else {
+        *stats = fd_context->stats;
+    }
+
+    return result;
+}
+
+uint64_t _pcomm_fd_metric( const pcomm_fd_stats_t *stats, pcomm_fd_metric_t metric )
+{
+    switch (metric) {
+        case PCOMM_FD_METRIC_BYTES:
+            return stats->bytes_in + stats->bytes_out;
+        case PCOMM_FD_METRIC_BYTES_IN:
+            return stats->bytes_in;
+        case PCOMM_FD_METRIC_BYTES_OUT:
+            return stats->bytes_out;
+        case PCOMM_FD_METRIC_SYSCALLS:
+            return stats->reads + stats->writes;
+        case PCOMM_FD_METRIC_EAGAINS:
+            return stats->eagains;
+        case PCOMM_FD_METRIC_CALLBACK_TIME:
+            return stats->callback_ns;
+        case PCOMM_FD_METRIC_QUEUE:
+            return (stats->write_queue_max > stats->read_buffer_max) ?
+                   stats->write_queue_max : stats->read_buffer_max;
+    }
+    return 0;
+}
 
-    if (context && context->initialized) {
-        switch(type) {
-            case PCOMM_STREAM_WRITE:
-                list = &context->write_fds;
-                break;
-            case PCOMM_STREAM_READ:
-                list = &context->read_fds;
-                break;
-            case PCOMM_STREAM_ERROR:
-                list = &context->error_fds;
-                break;
+/* keep the n heaviest seen so far in descending order; n is expected to be
+ * small next to the number of descriptors, so insertion beats a heap
+ */
+void _pcomm_rank_list( list_t *list, pcomm_stream_t stream, pcomm_fd_metric_t metric,
+                       pcomm_fd_rank_t *top, size_t n, size_t *filled )
+{
+    pcomm_fd_t *fd_context;
+    uint64_t value;
+    size_t i;
+
+    list_iterator_stop(list);
+    list_iterator_start(list);
+    while ( list_iterator_hasnext(list) ) {
+        if ( !(fd_context = list_iterator_next(list)) ) {
+            continue;
         }
-        
-        if (list && (fd >= 0) && (fd_context = _pcomm_get_fd(list, fd))) {
-            external_fd_context = fd_context->external_context;
+        value = _pcomm_fd_metric( &fd_context->stats, metric );
+        if ( (*filled == n) && (value <= top[n - 1].value) ) {
+            continue;
         }
+        i = (*filled < n) ? (*filled)++ : (n - 1);
+        for ( ; (i > 0) && (top[i - 1].value < value); i-- ) {
+            top[i] = top[i - 1];
+        }
+        top[i].fd = fd_context->file_descriptor;
+        top[i].stream = stream;
+        top[i].value = value;
     }
-    return external_fd_context;
+    list_iterator_stop(list);
 }
 
-pcomm_result_t pcomm_set_page_size( pcomm_context_t *context, size_t page_size )
+size_t pcomm_top_fds( pcomm_context_t *context, pcomm_fd_metric_t metric,
+                      pcomm_fd_rank_t *top, size_t n )
+{
+    size_t filled = 0;
+
+    if ( !context || !context->initialized || !top || !n ) {
+        return 0;
+    }
+    _pcomm_rank_list( &context->read_fds,  PCOMM_STREAM_READ,  metric, top, n, &filled );
+    _pcomm_rank_list( &context->write_fds, PCOMM_STREAM_WRITE, metric, top, n, &filled );
+    _pcomm_rank_list( &context->error_fds, PCOMM_STREAM_ERROR, metric, top, n, &filled );
+
+    return filled;
+}
+
+pcomm_result_t pcomm_set_prepare_callback( pcomm_context_t *context,
+                                           pcomm_callback_routine prepare_callback )
 {
     pcomm_result_t result = PCOMM_SUCCESS;
 
@@ -850,13 +3067,14 @@ pcomm_result_t pcomm_set_page_size( pcomm_context_t *context, size_t page_size )
     } else if (!context->initialized) {
         result = PCOMM_UNINITIALIZED_CONTEXT;
     } else {
-        context->page_size = page_size;
+        context->prepare_callback = prepare_callback;
     }
 
     return result;
 }
 
-pcomm_result_t pcomm_set_timeout( pcomm_context_t *context, struct timeval *timeout )
+pcomm_result_t pcomm_set_select_callback( pcomm_context_t *context,
+                                          pcomm_callback_routine select_callback )
 {
     pcomm_result_t result = PCOMM_SUCCESS;
 
@@ -865,31 +3083,51 @@ pcomm_result_t pcomm_set_timeout( pcomm_context_t *context, struct timeval *time
     } else if (!context->initialized) {
         result = PCOMM_UNINITIALIZED_CONTEXT;
     } else {
-        context->timeout.tv_sec = timeout->tv_sec;
-        context->timeout.tv_usec = timeout->tv_usec;
+        context->select_callback = select_callback;
     }
 
     return result;
 }
 
-pcomm_result_t pcomm_set_timeout_callback( pcomm_context_t *context, 
-                                           pcomm_callback_routine timeout_callback )
+pcomm_result_t pcomm_timer_add( pcomm_context_t *context, uint64_t timeout_ms,
+                                uint64_t interval_ms, pcomm_callback_timer callback,
+                                void *arg, pcomm_timer_t **timer )
 {
     pcomm_result_t result = PCOMM_SUCCESS;
+    pcomm_timer_t *new_timer = NULL;
+    uint64_t now;
 
     if (!context) {
         result = PCOMM_NULL_CONTEXT;
     } else if (!context->initialized) {
         result = PCOMM_UNINITIALIZED_CONTEXT;
+    } else if (context->exit_request) {
+        result = PCOMM_EXITING;
+    } else if (!callback) {
+        result = PCOMM_NULL_CALLBACK;
+    } else if ( !(new_timer = calloc( sizeof(pcomm_timer_t), 1 )) ) {
+        result = PCOMM_OUT_OF_MEMORY;
     } else {
-        context->timeout_callback = timeout_callback;
+        now = _pcomm_now_ms( context );
+        // an empty wheel may be far behind the clock, catch it up first
+        if ( !context->timers.count && (now > context->timers.current) ) {
+            context->timers.current = now;
+        }
+        new_timer->expires  = _pcomm_timer_deadline( context, timeout_ms );
+        new_timer->interval = interval_ms;
+        new_timer->callback = callback;
+        new_timer->arg      = arg;
+        new_timer->detached = (timer == NULL);
+        _pcomm_timer_link( &context->timers, new_timer );
+        if (timer) {
+            *timer = new_timer;
+        }
     }
 
     return result;
 }
 
-pcomm_result_t pcomm_set_prepare_callback( pcomm_context_t *context,
-                                           pcomm_callback_routine prepare_callback )
+pcomm_result_t pcomm_timer_cancel( pcomm_context_t *context, pcomm_timer_t *timer )
 {
     pcomm_result_t result = PCOMM_SUCCESS;
 
@@ -897,15 +3135,18 @@ pcomm_result_t pcomm_set_prepare_callback( pcomm_context_t *context,
         result = PCOMM_NULL_CONTEXT;
     } else if (!context->initialized) {
         result = PCOMM_UNINITIALIZED_CONTEXT;
+    } else if (!timer) {
+        result = PCOMM_NULL_TIMER;
     } else {
-        context->prepare_callback = prepare_callback;
+        _pcomm_timer_unlink( &context->timers, timer );
+        free( timer );
     }
 
     return result;
 }
 
-pcomm_result_t pcomm_set_select_callback( pcomm_context_t *context,
-                                          pcomm_callback_routine select_callback )
+pcomm_result_t pcomm_timer_reset( pcomm_context_t *context, pcomm_timer_t *timer,
+                                  uint64_t timeout_ms )
 {
     pcomm_result_t result = PCOMM_SUCCESS;
 
@@ -913,8 +3154,12 @@ pcomm_result_t pcomm_set_select_callback( pcomm_context_t *context,
         result = PCOMM_NULL_CONTEXT;
     } else if (!context->initialized) {
         result = PCOMM_UNINITIALIZED_CONTEXT;
+    } else if (!timer) {
+        result = PCOMM_NULL_TIMER;
     } else {
-        context->select_callback = select_callback;
+        _pcomm_timer_unlink( &context->timers, timer );
+        timer->expires = _pcomm_timer_deadline( context, timeout_ms );
+        _pcomm_timer_link( &context->timers, timer );
     }
 
     return result;
@@ -1069,6 +3314,170 @@ pcomm_result_t pcomm_monitor_error_fd( pcomm_context_t *context, int fd,
     return result;
 }
 
+pcomm_result_t pcomm_add_timer_fd( pcomm_context_t *context,
+                                   const struct timespec *initial,
+                                   const struct timespec *interval,
+                                   pcomm_callback_expired expired_callback,
+                                   int *fd )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+    struct itimerspec spec;
+    int timer_fd = -1;
+
+    if ( !context ) {
+        result = PCOMM_NULL_CONTEXT;
+    } else if (!context->initialized) {
+        result = PCOMM_UNINITIALIZED_CONTEXT;
+    } else if (context->exit_request) {
+        result = PCOMM_EXITING;
+    } else if (!expired_callback) {
+        result = PCOMM_NULL_CALLBACK;
+    } else if (!initial || !fd) {
+        result = PCOMM_NULL_FD;
+    } else if ( (timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0 ) {
+        result = PCOMM_FD_OPEN_FAILED;
+    } else {
+        memset( &spec, 0, sizeof(spec) );
+        spec.it_value = *initial;
+        if (interval) {
+            spec.it_interval = *interval;
+        }
+        // a zero it_value would disarm the timer, fire as soon as possible
+        if ( !spec.it_value.tv_sec && !spec.it_value.tv_nsec ) {
+            spec.it_value.tv_nsec = 1;
+        }
+        if ( timerfd_settime(timer_fd, 0, &spec, NULL) < 0 ) {
+            result = PCOMM_FD_OPEN_FAILED;
+        } else if ( (result = _pcomm_add_input_fd( &context->read_fds, timer_fd,
+                                                   1    /*check_only*/,
+                                                   NULL /*ready_callback*/,
+                                                   NULL /*io_callback*/,
+                                                   NULL /*close_callback*/ )) == PCOMM_SUCCESS ) {
+            _pcomm_get_fd( &context->read_fds, timer_fd )->expired_callback = expired_callback;
+            *fd = timer_fd;
+        }
+        if ( result != PCOMM_SUCCESS ) {
+            close( timer_fd );
+        }
+    }
+
+    return result;
+}
+
+pcomm_result_t pcomm_remove_timer_fd( pcomm_context_t *context, int fd )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+    pcomm_fd_t *fd_context = NULL;
+
+    if (!context) {
+        result = PCOMM_NULL_CONTEXT;
+    } else if (!context->initialized) {
+        result = PCOMM_UNINITIALIZED_CONTEXT;
+    } else if ( !(fd_context = _pcomm_get_fd(&context->read_fds, fd)) ||
+                !fd_context->expired_callback ) {
+        result = PCOMM_FD_NOT_FOUND;
+    } else if ( (result = _pcomm_remove_fd(context, &context->read_fds, fd)) == PCOMM_SUCCESS ) {
+        close( fd );
+    }
+
+    return result;
+}
+
+pcomm_result_t pcomm_set_fd_idle_timeout( pcomm_context_t *context, pcomm_stream_t type,
+                                          int fd, uint64_t timeout_ms )
+{
+    return _pcomm_fd_arm( context, type, fd, timeout_ms, 1 /*idle*/ );
+}
+
+pcomm_result_t pcomm_set_fd_deadline( pcomm_context_t *context, pcomm_stream_t type,
+                                      int fd, uint64_t lifetime_ms )
+{
+    return _pcomm_fd_arm( context, type, fd, lifetime_ms, 0 /*idle*/ );
+}
+
+pcomm_result_t pcomm_add_signal( pcomm_context_t *context, int signo,
+                                 pcomm_callback_signal signal_callback )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+    sigset_t one;
+    sigset_t previous;
+    int registered;
+    int fd;
+
+    if (!context) {
+        result = PCOMM_NULL_CONTEXT;
+    } else if (!context->initialized) {
+        result = PCOMM_UNINITIALIZED_CONTEXT;
+    } else if ( (signo <= 0) || (signo >= NSIG) || (signo == SIGKILL) || (signo == SIGSTOP) ) {
+        // the kernel never queues SIGKILL or SIGSTOP to a signalfd
+        result = PCOMM_INVALID_SIGNAL;
+    } else if (!signal_callback) {
+        result = PCOMM_NULL_CALLBACK;
+    } else {
+        sigemptyset( &one );
+        sigaddset( &one, signo );
+        registered = sigismember( &context->signals, signo );
+        sigaddset( &context->signals, signo );
+        if ( (fd = signalfd( context->signal_fd, &context->signals,
+                             SFD_NONBLOCK | SFD_CLOEXEC )) < 0 ) {
+            // a failed re-registration keeps the one already in place
+            if ( !registered ) {
+                sigdelset( &context->signals, signo );
+            }
+            result = PCOMM_SIGNAL_FAILED;
+        } else {
+            context->signal_fd = fd;
+            context->signal_callbacks[signo] = signal_callback;
+            // remember whether we did the blocking so removal can undo it
+            pthread_sigmask( SIG_BLOCK, &one, &previous );
+            if ( !sigismember( &previous, signo ) ) {
+                sigaddset( &context->signals_blocked, signo );
+            }
+        }
+    }
+
+    return result;
+}
+
+pcomm_result_t pcomm_remove_signal( pcomm_context_t *context, int signo )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+    sigset_t one;
+    int remaining;
+
+    if (!context) {
+        result = PCOMM_NULL_CONTEXT;
+    } else if (!context->initialized) {
+        result = PCOMM_UNINITIALIZED_CONTEXT;
+    } else if ( (signo <= 0) || (signo >= NSIG) ) {
+        result = PCOMM_INVALID_SIGNAL;
+    } else if ( (context->signal_fd < 0) || !sigismember( &context->signals, signo ) ) {
+        result = PCOMM_FD_NOT_FOUND;
+    } else {
+        sigdelset( &context->signals, signo );
+        context->signal_callbacks[signo] = NULL;
+        for ( remaining = 1; remaining < NSIG; remaining++ ) {
+            if ( sigismember( &context->signals, remaining ) ) {
+                break;
+            }
+        }
+        if ( remaining == NSIG ) {
+            close( context->signal_fd );
+            context->signal_fd = -1;
+        } else {
+            signalfd( context->signal_fd, &context->signals, 0 );
+        }
+        if ( sigismember( &context->signals_blocked, signo ) ) {
+            sigdelset( &context->signals_blocked, signo );
+            sigemptyset( &one );
+            sigaddset( &one, signo );
+            pthread_sigmask( SIG_UNBLOCK, &one, NULL );
+        }
+    }
+
+    return result;
+}
+
 pcomm_result_t pcomm_remove_write_fd( pcomm_context_t *context, int fd )
 { 
     pcomm_result_t result = PCOMM_SUCCESS;
@@ -1090,6 +3499,255 @@ pcomm_result_t pcomm_remove_error_fd( pcomm_context_t *context, int fd )
     return result;
 }
 
+/* Descriptor handed to another context through its task queue */
+struct PCOMM_HANDOFF {
+    int fd;
+    pcomm_callback_io io_callback;
+    pcomm_callback_ready close_callback;
+};
+
+void _pcomm_group_adopt_fd( pcomm_context_t *context, void *arg )
+{
+    struct PCOMM_HANDOFF *handoff = (struct PCOMM_HANDOFF *)arg;
+
+    if ( pcomm_add_read_fd( context, handoff->fd, handoff->io_callback,
+                            handoff->close_callback ) != PCOMM_SUCCESS ) {
+        if (handoff->close_callback) {
+            handoff->close_callback( context, handoff->fd );
+        }
+    }
+    free( handoff );
+}
+
+void *_pcomm_group_thread( void *arg )
+{
+    return (void *)(intptr_t)pcomm_main( (pcomm_context_t *)arg );
+}
+
+pcomm_result_t pcomm_group_init( pcomm_group_t *group, size_t size )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+    size_t i;
+
+    if (!group) {
+        return PCOMM_NULL_GROUP;
+    }
+    memset( group, 0, sizeof(pcomm_group_t) );
+    if (!size) {
+        result = PCOMM_INIT_FAILED;
+    } else if ( !(group->contexts   = calloc( sizeof(pcomm_context_t), size )) ||
+                !(group->threads    = calloc( sizeof(pthread_t), size )) ||
+                !(group->listen_fds = calloc( sizeof(int), size )) ) {
+        result = PCOMM_OUT_OF_MEMORY;
+    } else {
+        for ( i = 0; i < size; i++ ) {
+            group->listen_fds[i] = -1;
+            if ( (result = pcomm_init( &group->contexts[i] )) != PCOMM_SUCCESS ) {
+                break;
+            }
+            group->size++;
+            pcomm_set_blocking( &group->contexts[i], 1 );
+            pcomm_set_persistent( &group->contexts[i], 1 );
+        }
+    }
+    if ( result != PCOMM_SUCCESS ) {
+        pcomm_group_destroy( group );
+    }
+
+    return result;
+}
+
+pcomm_result_t pcomm_group_destroy( pcomm_group_t *group )
+{
+    size_t i;
+
+    if (!group) {
+        return PCOMM_NULL_GROUP;
+    }
+    if (group->running) {
+        pcomm_group_stop( group, 1 );
+        pcomm_group_join( group );
+    }
+    for ( i = 0; i < group->size; i++ ) {
+        if ( group->listen_fds[i] >= 0 ) {
+            close( group->listen_fds[i] );
+        }
+        pcomm_destroy( &group->contexts[i] );
+    }
+    free( group->contexts );
+    free( group->threads );
+    free( group->listen_fds );
+    memset( group, 0, sizeof(pcomm_group_t) );
+
+    return PCOMM_SUCCESS;
+}
+
+pcomm_context_t *pcomm_group_context( pcomm_group_t *group, size_t index )
+{
+    if ( group && (index < group->size) ) {
+        return &group->contexts[index];
+    }
+    return NULL;
+}
+
+pcomm_result_t pcomm_group_start( pcomm_group_t *group )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+    size_t started;
+    size_t i;
+
+    if (!group) {
+        return PCOMM_NULL_GROUP;
+    } else if (!group->size) {
+        return PCOMM_UNINITIALIZED_CONTEXT;
+    } else if (group->running) {
+        return PCOMM_SUCCESS;
+    }
+
+    for ( i = 0; i < group->size; i++ ) {
+        if ( pthread_create( &group->threads[i], NULL, _pcomm_group_thread,
+                             &group->contexts[i] ) ) {
+            result = PCOMM_THREAD_FAILED;
+            break;
+        }
+        group->running++;
+    }
+    // unwind only the threads that started, and clear the stop we gave
+    // them so a later start can run the whole group
+    if ( result != PCOMM_SUCCESS ) {
+        started = (size_t)group->running;
+        for ( i = 0; i < started; i++ ) {
+            pcomm_stop( &group->contexts[i], 1 );
+        }
+        pcomm_group_join( group );
+        for ( i = 0; i < started; i++ ) {
+            group->contexts[i].exit_request = 0;
+            group->contexts[i].exit_now = 0;
+        }
+    }
+
+    return result;
+}
+
+pcomm_result_t pcomm_group_stop( pcomm_group_t *group, int immediately )
+{
+    size_t i;
+
+    if (!group) {
+        return PCOMM_NULL_GROUP;
+    }
+    for ( i = 0; i < group->size; i++ ) {
+        pcomm_stop( &group->contexts[i], immediately );
+    }
+
+    return PCOMM_SUCCESS;
+}
+
+pcomm_result_t pcomm_group_join( pcomm_group_t *group )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+    void *thread_result = NULL;
+    size_t i;
+
+    if (!group) {
+        return PCOMM_NULL_GROUP;
+    }
+    // report the first context that stopped with an error
+    for ( i = 0; i < (size_t)group->running; i++ ) {
+        pthread_join( group->threads[i], &thread_result );
+        if ( (result == PCOMM_SUCCESS) && ((intptr_t)thread_result != PCOMM_SUCCESS) ) {
+            result = (pcomm_result_t)(intptr_t)thread_result;
+        }
+    }
+    group->running = 0;
+
+    return result;
+}
+
+pcomm_result_t pcomm_group_listen( pcomm_group_t *group, const struct sockaddr *addr,
+                                   socklen_t addrlen, int backlog,
+                                   pcomm_callback_ready accept_callback )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+    struct sockaddr_storage bound;
+    socklen_t bound_len = sizeof(bound);
+    int on = 1;
+    int fd = -1;
+    size_t i;
+
+    if (!group) {
+        return PCOMM_NULL_GROUP;
+    } else if (!addr || (addrlen > sizeof(bound))) {
+        return PCOMM_SOCKET_FAILED;
+    } else if (!accept_callback) {
+        return PCOMM_NULL_CALLBACK;
+    }
+
+    memcpy( &bound, addr, addrlen );
+    bound_len = addrlen;
+    for ( i = 0; (i < group->size) && (result == PCOMM_SUCCESS); i++ ) {
+        if ( (fd = socket( addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 )) < 0 ) {
+            result = PCOMM_SOCKET_FAILED;
+        } else if ( setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) ) ||
+                    setsockopt( fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on) ) ||
+                    bind( fd, (struct sockaddr *)&bound, bound_len ) ||
+                    listen( fd, backlog ) ) {
+            result = PCOMM_SOCKET_FAILED;
+            close( fd );
+        } else {
+            // pin an ephemeral port so every listener shares it
+            if ( i == 0 ) {
+                bound_len = sizeof(bound);
+                if ( getsockname( fd, (struct sockaddr *)&bound, &bound_len ) ) {
+                    result = PCOMM_SOCKET_FAILED;
+                    close( fd );
+                    break;
+                }
+            }
+            group->listen_fds[i] = fd;
+            if ( (result = pcomm_monitor_read_fd( &group->contexts[i], fd,
+                                                  accept_callback )) != PCOMM_SUCCESS ) {
+                close( fd );
+                group->listen_fds[i] = -1;
+            }
+        }
+    }
+
+    return result;
+}
+
+pcomm_result_t pcomm_group_dispatch_fd( pcomm_group_t *group, int fd,
+                                        pcomm_callback_io io_callback,
+                                        pcomm_callback_ready close_callback )
+{
+    pcomm_result_t result = PCOMM_SUCCESS;
+    struct PCOMM_HANDOFF *handoff = NULL;
+    size_t index;
+
+    if (!group) {
+        result = PCOMM_NULL_GROUP;
+    } else if (!group->size) {
+        result = PCOMM_UNINITIALIZED_CONTEXT;
+    } else if (fd < 0) {
+        result = PCOMM_FD_NEGATIVE;
+    } else if (!io_callback) {
+        result = PCOMM_NULL_CALLBACK;
+    } else if ( !(handoff = malloc(sizeof(struct PCOMM_HANDOFF))) ) {
+        result = PCOMM_OUT_OF_MEMORY;
+    } else {
+        handoff->fd = fd;
+        handoff->io_callback = io_callback;
+        handoff->close_callback = close_callback;
+        index = __atomic_fetch_add( &group->next, 1, __ATOMIC_RELAXED ) % group->size;
+        if ( (result = pcomm_post( &group->contexts[index], _pcomm_group_adopt_fd,
+                                   handoff )) != PCOMM_SUCCESS ) {
+            free( handoff );
+        }
+    }
+
+    return result;
+}
+
 const char* pcomm_strresult(pcomm_result_t result)
 {
     switch (result) {
@@ -1145,6 +3803,24 @@ const char* pcomm_strresult(pcomm_result_t result)
             return "pcomm: invalid stream type";
         case PCOMM_EXITING:
             return "pcomm: exiting";
+        case PCOMM_NULL_TIMER:
+            return "pcomm: null timer";
+        case PCOMM_NULL_GROUP:
+            return "pcomm: null group";
+        case PCOMM_THREAD_FAILED:
+            return "pcomm: thread creation failed";
+        case PCOMM_SOCKET_FAILED:
+            return "pcomm: socket setup failed";
+        case PCOMM_NULL_JOB:
+            return "pcomm: null job";
+        case PCOMM_INVALID_SIGNAL:
+            return "pcomm: invalid signal";
+        case PCOMM_SIGNAL_FAILED:
+            return "pcomm: signal descriptor setup failed";
+        case PCOMM_INVALID_HISTOGRAM:
+            return "pcomm: invalid histogram";
+        case PCOMM_FD_WOULD_BLOCK:
+            return "pcomm: operation would block";
     }
     return "Unrecognized";
 }
@@ -29,7 +29,16 @@
 #include <sys/ioctl.h>
 #include <sys/time.h>
 #include <sys/select.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sched.h>
+#include <execinfo.h>
 
 #include "simclist.h"
 
@@ -44,6 +53,15 @@
 #define PCOMM_STDOUT 1
 #define PCOMM_STDERR 2
 
+/* Timer wheel geometry: four levels of 256 one-millisecond slots, which
+ * covers just under 50 days before timers are parked on the top level.
+ */
+#define PCOMM_WHEEL_BITS   8
+#define PCOMM_WHEEL_SLOTS  (1 << PCOMM_WHEEL_BITS)
+#define PCOMM_WHEEL_MASK   (PCOMM_WHEEL_SLOTS - 1)
+#define PCOMM_WHEEL_WORDS  (PCOMM_WHEEL_SLOTS / 64)
+#define PCOMM_WHEEL_LEVELS 4
+
 /* Result Codes */
 enum PCOMM_RESULT {
     /* 0 */
@@ -77,7 +95,16 @@ enum PCOMM_RESULT {
     PCOMM_DUPLICATE_FD,
     PCOMM_INVALID_STREAM_TYPE,
     /* 25 */
-    PCOMM_EXITING
+    PCOMM_EXITING,
+    PCOMM_NULL_TIMER,
+    PCOMM_NULL_GROUP,
+    PCOMM_THREAD_FAILED,
+    PCOMM_SOCKET_FAILED,
+    PCOMM_NULL_JOB,
+    PCOMM_INVALID_SIGNAL,
+    PCOMM_SIGNAL_FAILED,
+    PCOMM_INVALID_HISTOGRAM,
+    PCOMM_FD_WOULD_BLOCK
 };
 typedef enum PCOMM_RESULT pcomm_result_t;
 
@@ -100,6 +127,12 @@ typedef struct PCOMM_CONTEXT pcomm_context_t;
 struct PCOMM_FD;
 typedef struct PCOMM_FD pcomm_fd_t;
 
+struct PCOMM_TIMER;
+typedef struct PCOMM_TIMER pcomm_timer_t;
+
+struct PCOMM_TASK;
+typedef struct PCOMM_TASK pcomm_task_t;
+
 /* pcomm_callback_ready is called when a descriptor has detected an I/O
  * event, such as a close, or I/O can now be sent/received
  */
@@ -115,11 +148,267 @@ typedef void (* pcomm_callback_io)(pcomm_context_t *context, int fd, uint8_t *da
  */
 typedef void (* pcomm_callback_routine)(pcomm_context_t *context);
 
+/* pcomm_callback_task is called on the loop thread for work handed over
+ * with pcomm_post
+ */
+typedef void (* pcomm_callback_task)(pcomm_context_t *context, void *arg);
+
+/* pcomm_callback_job runs on an offload worker thread; it must not touch
+ * the context
+ */
+typedef void (* pcomm_callback_job)(void *arg);
+
+/* pcomm_callback_expired is called when a timer descriptor added with
+ * pcomm_add_timer_fd fires, with the number of expirations since the
+ * previous call (more than one if the loop was busy)
+ */
+typedef void (* pcomm_callback_expired)(pcomm_context_t *context, int fd, uint64_t expirations);
+
+/* pcomm_callback_signal is called from the loop for each signal added with
+ * pcomm_add_signal, with the details the kernel recorded for it
+ */
+typedef void (* pcomm_callback_signal)(pcomm_context_t *context, int signo,
+                                       const struct signalfd_siginfo *info);
+
+/* pcomm_callback_timer is called when a timer added with pcomm_timer_add
+ * expires
+ */
+typedef void (* pcomm_callback_timer)(pcomm_context_t *context, pcomm_timer_t *timer, void *arg);
+
 
 /* * * * * * * * * * * * * *
  * Context Data Stuctures  *
  * * * * * * * * * * * * * */
 
+/* A single timer. Timers are linked into one slot of the context's timer
+ * wheel while scheduled.
+ */
+struct PCOMM_TIMER {
+    pcomm_timer_t *next;
+    pcomm_timer_t *prev;
+
+    uint64_t expires;   /* absolute expiry, in wheel ticks (milliseconds) */
+    uint64_t interval;  /* re-arm period in milliseconds, 0 for one-shot */
+    int level;          /* wheel level, or a negative state when not scheduled */
+    int slot;
+    int detached;       /* no handle was returned, free after a one-shot fires */
+
+    pcomm_callback_timer callback;
+    void *arg;
+}; // pcomm_timer_t
+
+/* Hierarchical timing wheel. Level 0 has one slot per tick; each higher level
+ * has slots that span a full revolution of the level below it, and its
+ * timers are cascaded down when the lower level wraps.
+ */
+struct PCOMM_WHEEL {
+    pcomm_timer_t *slots[PCOMM_WHEEL_LEVELS][PCOMM_WHEEL_SLOTS];
+    uint64_t occupied[PCOMM_WHEEL_LEVELS][PCOMM_WHEEL_WORDS];
+    uint64_t current;   /* next tick to be processed */
+    size_t count;       /* timers scheduled in the wheel */
+
+    pcomm_timer_t *pending; /* expired timers awaiting dispatch */
+    pcomm_timer_t *idle;    /* inactive timers that still have a handle */
+    pcomm_timer_t *running;
+};
+
+/* A unit of work posted to the loop from any thread */
+struct PCOMM_TASK {
+    pcomm_task_t *next;
+    pcomm_callback_task callback;
+    void *arg;
+}; // pcomm_task_t
+
+/* Intrusive multi-producer single-consumer queue. Producers swap themselves
+ * in at the head with one atomic exchange; only the loop thread moves the
+ * tail. The stub node keeps the queue non-empty so neither side ever has
+ * to touch both ends.
+ */
+struct PCOMM_QUEUE {
+    pcomm_task_t *head;
+    pcomm_task_t *tail;
+    pcomm_task_t stub;
+};
+
+/* A job handed to the offload pool. The completion travels back to the loop
+ * as the embedded task, which must stay the first member so the task queue
+ * can release the whole job.
+ */
+struct PCOMM_JOB {
+    pcomm_task_t task;
+    pcomm_context_t *context;
+    pcomm_callback_job job_callback;
+    pcomm_callback_task done_callback;
+    void *arg;
+};
+
+/* Loop counters, always on and only touched by the loop thread */
+struct PCOMM_STATS {
+    uint64_t since;             /* pcomm_now() when counting started */
+    uint64_t iterations;        /* select calls */
+    uint64_t wakeups;           /* select returns with something ready */
+    uint64_t timeouts;          /* select returns with nothing ready */
+    uint64_t interrupts;        /* select calls cut short by a signal */
+    uint64_t ready_fds;         /* descriptors reported ready, summed */
+    uint64_t max_ready_fds;     /* most descriptors ready in one wakeup */
+    uint64_t reads;
+    uint64_t bytes_read;
+    uint64_t writes;
+    uint64_t bytes_written;
+    uint64_t timers_fired;
+    uint64_t tasks_run;
+    uint64_t signals;
+}; // pcomm_stats_t
+typedef struct PCOMM_STATS pcomm_stats_t;
+
+/* Log-linear histogram of nanosecond durations, in the style of HDR
+ * histograms: each power of two is split into PCOMM_HIST_SUB_BUCKETS linear
+ * buckets, so any recorded value is known to within about 6%. Values past
+ * 2^PCOMM_HIST_MAX_EXP ns (about a minute) land in the last bucket.
+ */
+#define PCOMM_HIST_SUB_BITS    4
+#define PCOMM_HIST_SUB_BUCKETS (1 << PCOMM_HIST_SUB_BITS)
+#define PCOMM_HIST_MAX_EXP     36
+#define PCOMM_HIST_BUCKETS     ((PCOMM_HIST_MAX_EXP - PCOMM_HIST_SUB_BITS + 2) * PCOMM_HIST_SUB_BUCKETS)
+
+struct PCOMM_HISTOGRAM {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t buckets[PCOMM_HIST_BUCKETS];
+}; // pcomm_histogram_t
+typedef struct PCOMM_HISTOGRAM pcomm_histogram_t;
+
+/* What each of the loop's histograms times */
+enum PCOMM_HIST {
+    PCOMM_HIST_WAIT = 0,    /* blocked in select */
+    PCOMM_HIST_PREPARE,     /* prepare_callback */
+    PCOMM_HIST_SELECT,      /* select_callback */
+    PCOMM_HIST_TIMEOUT,     /* timeout_callback */
+    PCOMM_HIST_IO,          /* io, ready and expired callbacks */
+    PCOMM_HIST_TIMER,       /* timer callbacks */
+    PCOMM_HIST_TASK,        /* posted tasks and offload completions */
+    PCOMM_HIST_SIGNAL,      /* signal callbacks */
+    PCOMM_HIST_ITERATION,   /* one whole pass of the loop */
+    PCOMM_HIST_COUNT
+};
+typedef enum PCOMM_HIST pcomm_hist_t;
+
+/* Trace ring. Each record is written by the loop thread with a clock read
+ * and a few stores, no locks or formatting; the oldest records are
+ * overwritten once the ring is full.
+ */
+#define PCOMM_TRACE_DEFAULT 4096    /* records kept when debug turns tracing on */
+#define PCOMM_TRACE_MAGIC   0x52544350  /* "PCTR" at the start of a written trace */
+#define PCOMM_TRACE_VERSION 1
+
+enum PCOMM_TRACE_EVENT {
+    PCOMM_TRACE_ITERATION = 0,  /* value: highest fd selected on */
+    PCOMM_TRACE_WAKE,           /* value: descriptors select reported ready */
+    PCOMM_TRACE_TIMEOUT,        /* select returned with nothing ready */
+    PCOMM_TRACE_INTERRUPTED,    /* select was interrupted and is retried */
+    PCOMM_TRACE_SELECT_ERROR,   /* value: errno */
+    PCOMM_TRACE_READY,          /* fd ready, check-only descriptor */
+    PCOMM_TRACE_READ,           /* value: bytes read */
+    PCOMM_TRACE_WRITE,          /* value: bytes written */
+    PCOMM_TRACE_IO_FAILED,      /* value: pcomm_result_t of the read or write */
+    PCOMM_TRACE_EXPIRED,        /* fd evicted by its idle or lifetime timer */
+    PCOMM_TRACE_CLOSE,          /* fd removed by the loop */
+    PCOMM_TRACE_CALLBACK,       /* value: pcomm_hist_t kind of callback entered */
+    PCOMM_TRACE_COUNT
+};
+typedef enum PCOMM_TRACE_EVENT pcomm_trace_event_t;
+
+struct PCOMM_TRACE_RECORD {
+    uint64_t ns;        /* CLOCK_MONOTONIC */
+    int64_t value;
+    int32_t fd;         /* -1 when the event has no descriptor */
+    uint32_t event;     /* pcomm_trace_event_t */
+}; // pcomm_trace_record_t
+typedef struct PCOMM_TRACE_RECORD pcomm_trace_record_t;
+
+/* pcomm_trace_write output: this header followed by count records */
+struct PCOMM_TRACE_HEADER {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t count;
+}; // pcomm_trace_header_t
+typedef struct PCOMM_TRACE_HEADER pcomm_trace_header_t;
+
+struct PCOMM_TRACE {
+    pcomm_trace_record_t *records;  /* NULL when tracing is off */
+    uint64_t mask;                  /* capacity - 1, capacity a power of two */
+    uint64_t head;                  /* records ever written */
+};
+
+/* What the watchdog saw when a loop pass overran its threshold */
+#define PCOMM_STALL_FRAMES 64
+
+struct PCOMM_STALL {
+    uint64_t elapsed_ns;    /* how long the pass had been running */
+    pcomm_hist_t running;   /* callback kind, PCOMM_HIST_ITERATION for the loop itself */
+    int fd;                 /* descriptor the callback belongs to, or -1 */
+    int depth;              /* frames captured, 0 if the loop did not answer */
+    void *frames[PCOMM_STALL_FRAMES];   /* backtrace of the loop thread */
+}; // pcomm_stall_t
+typedef struct PCOMM_STALL pcomm_stall_t;
+
+/* pcomm_callback_stall runs on the watchdog thread while the loop is stuck;
+ * it must not touch the context beyond identifying it
+ */
+typedef void (* pcomm_callback_stall)(pcomm_context_t *context, const pcomm_stall_t *stall);
+
+/* Watchdog state; the loop publishes where it is with relaxed stores and
+ * the watchdog thread polls them
+ */
+struct PCOMM_WATCHDOG {
+    pthread_t thread;
+    pthread_t loop_thread;
+    int loop_known;         /* loop_thread is valid */
+    int running;            /* watchdog thread started */
+    int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    uint64_t threshold_ns;
+    pcomm_callback_stall callback;
+    uint64_t busy_since;    /* when the current pass left select, 0 while waiting */
+    uint64_t pass;
+    int running_kind;
+    int running_fd;
+    int captured;           /* set by the loop thread once frames/depth are written */
+    int depth;
+    void *frames[PCOMM_STALL_FRAMES];
+    pcomm_stall_t stall;
+};
+
+/* Ring buffer of jobs owned by one offload worker */
+struct PCOMM_DEQUE {
+    pthread_mutex_t lock;
+    struct PCOMM_JOB **jobs;
+    size_t capacity;
+    size_t head;
+    size_t count;
+};
+
+/* Worker threads for CPU-heavy work that should not run inline in the loop.
+ * Each worker has its own deque and steals from the others when it is empty.
+ */
+struct PCOMM_POOL {
+    pthread_t *threads;
+    struct PCOMM_DEQUE *deques;
+    size_t size;            /* workers running */
+    size_t capacity;        /* deques allocated */
+    size_t next;            /* round-robin cursor, loop thread only */
+    pthread_mutex_t lock;   /* only for sleeping and waking idle workers */
+    pthread_cond_t ready;
+    size_t queued;          /* jobs sitting in any deque */
+    size_t idle;            /* workers asleep or about to be */
+    int stopping;
+    size_t outstanding;     /* jobs whose completion has not run yet */
+};
+
 /* The pcomm context object used for managing all file descriptors and program
  * state information.
  */
@@ -136,12 +425,86 @@ struct PCOMM_CONTEXT {
     pcomm_callback_routine select_callback;
     pcomm_callback_routine timeout_callback;
     struct timeval timeout;
+    struct PCOMM_WHEEL timers;
+    int blocking;
+    int wake_fd;        /* eventfd used by pcomm_wakeup and pcomm_stop */
+    int wake_pending;
+    int sleeping;       /* set while the loop may be blocked in select */
+    int persistent;     /* keep running with nothing registered */
+    uint64_t busy_poll_us;      /* longest spin before sleeping, 0 = off */
+    uint64_t busy_poll_gap_us;  /* smoothed time between events */
+    uint64_t last_event_us;
+    uint64_t now_ns;    /* clock sampled once per loop iteration */
+    int coarse_clock;
+    int looping;        /* set while pcomm_main is running the loop */
+    struct PCOMM_QUEUE tasks;
+    struct PCOMM_POOL offload;
+    int signal_fd;      /* signalfd for pcomm_add_signal, -1 until used */
+    sigset_t signals;           /* signals routed through signal_fd */
+    sigset_t signals_blocked;   /* the subset pcomm blocked itself */
+    pcomm_callback_signal signal_callbacks[NSIG];
+    pcomm_stats_t stats;
+    pcomm_histogram_t *histograms;  /* PCOMM_HIST_COUNT of them, NULL when off */
+    struct PCOMM_WATCHDOG watchdog;
+    struct PCOMM_TRACE trace;
+    int backend_fd;         /* epoll set for pcomm_get_backend_fd, -1 until used */
+    int backend_timer_fd;   /* fires in the backend set when a timer is due */
+    uint32_t *backend_events;   /* events registered per descriptor */
+    int dispatching;            /* depth of descriptor dispatch */
+    pcomm_fd_t *retired;        /* removed while dispatching, not yet freed */
 
     int debug;
-    int exit_now;
-    int exit_request;
+    volatile int exit_now;      /* may be set by pcomm_stop on another thread */
+    volatile int exit_request;
 }; // pcomm_context_t
 
+/* A group of contexts, each run by its own thread. Connections are spread
+ * over the contexts either by the kernel (one SO_REUSEPORT listener per
+ * context) or by handing descriptors out round-robin.
+ */
+struct PCOMM_GROUP {
+    pcomm_context_t *contexts;
+    pthread_t *threads;
+    int *listen_fds;
+    size_t size;
+    size_t next;        /* round-robin cursor for pcomm_group_dispatch_fd */
+    int running;
+}; // pcomm_group_t
+typedef struct PCOMM_GROUP pcomm_group_t;
+
+/* Per-descriptor counters, kept in each pcomm_fd_t */
+struct PCOMM_FD_STATS {
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t reads;             /* read calls, including empty ones */
+    uint64_t writes;            /* write calls */
+    uint64_t eagains;           /* calls that would have blocked */
+    uint64_t callback_ns;       /* time in this fd's callbacks, histograms on */
+    uint64_t write_queue_max;   /* most bytes waiting to be written */
+    uint64_t read_buffer_max;   /* most bytes held before the io callback */
+}; // pcomm_fd_stats_t
+typedef struct PCOMM_FD_STATS pcomm_fd_stats_t;
+
+/* Metrics pcomm_top_fds can rank descriptors by */
+enum PCOMM_FD_METRIC {
+    PCOMM_FD_METRIC_BYTES = 0,  /* in plus out */
+    PCOMM_FD_METRIC_BYTES_IN,
+    PCOMM_FD_METRIC_BYTES_OUT,
+    PCOMM_FD_METRIC_SYSCALLS,
+    PCOMM_FD_METRIC_EAGAINS,
+    PCOMM_FD_METRIC_CALLBACK_TIME,
+    PCOMM_FD_METRIC_QUEUE
+};
+typedef enum PCOMM_FD_METRIC pcomm_fd_metric_t;
+
+/* One entry of a pcomm_top_fds ranking */
+struct PCOMM_FD_RANK {
+    int fd;
+    pcomm_stream_t stream;
+    uint64_t value;
+}; // pcomm_fd_rank_t
+typedef struct PCOMM_FD_RANK pcomm_fd_rank_t;
+
 /* The file descriptor context object, used for tracking each individual
  * file descriptor.
  */
@@ -150,6 +513,7 @@ struct PCOMM_FD {
     pcomm_callback_ready ready_callback;
     pcomm_callback_io io_callback;
     pcomm_callback_ready close_callback;
+    pcomm_callback_expired expired_callback;
 
     void* external_context;
 
@@ -159,6 +523,16 @@ struct PCOMM_FD {
     size_t offset;
     int last_read_empty;
     int check_only;
+
+    pcomm_stream_t stream;
+    uint64_t idle_timeout;      /* milliseconds without activity before eviction */
+    uint64_t last_activity;
+    pcomm_timer_t idle_timer;
+    pcomm_timer_t deadline_timer;
+    pcomm_fd_stats_t stats;
+
+    int removed;            /* removed during dispatch, freed once it ends */
+    pcomm_fd_t *retired;    /* next in the context's list of such contexts */
 }; // pcomm_fd_t
 
 
@@ -170,15 +544,138 @@ struct PCOMM_FD {
 pcomm_result_t pcomm_init( pcomm_context_t *context );
 pcomm_result_t pcomm_destroy( pcomm_context_t *context );
 
-/* main loop control */
+/* main loop control; pcomm_stop may be called from any thread and wakes
+ * the loop if it is waiting in select */
 pcomm_result_t pcomm_main( pcomm_context_t *context );
 pcomm_result_t pcomm_stop( pcomm_context_t *context, int immediately );
 
+/* Run a single pass of the loop: wait for at most timeout_ms (or as long as
+ * the context's own timeout allows if negative), then dispatch descriptors,
+ * timers and posted tasks. Returns PCOMM_FD_NOT_FOUND, without stopping the
+ * context, when there is nothing to wait for, and PCOMM_EXITING once
+ * pcomm_stop has taken effect.
+ */
+pcomm_result_t pcomm_run_once( pcomm_context_t *context, int timeout_ms );
+
+/* An epoll descriptor that becomes readable whenever pcomm_run_once has work:
+ * a watched descriptor is ready, a timer is due, a task was posted, or a
+ * signal arrived. Add it to a host event loop and call pcomm_run_once with a
+ * zero timeout when it fires. Each pass leaves it up to date; after changing
+ * descriptors or timers from outside a callback, call pcomm_run_once (or this
+ * function) again to resync it. Returns -1 on failure.
+ */
+int pcomm_get_backend_fd( pcomm_context_t *context );
+
+/* In blocking mode a zero timeout makes select wait until a descriptor is
+ * ready, the next timer is due, or pcomm_wakeup is called, instead of
+ * polling. A non-zero timeout still bounds the wait.
+ */
+pcomm_result_t pcomm_set_blocking( pcomm_context_t *context, int blocking );
+int pcomm_get_blocking( pcomm_context_t *context );
+
+/* Monotonic time in nanoseconds. While the loop runs this is sampled once
+ * per iteration, when select returns, so every callback and timer in that
+ * pass sees the same value without a clock read of its own. Outside the loop
+ * the clock is read on each call.
+ */
+uint64_t pcomm_now( pcomm_context_t *context );
+
+/* The coarse clock (CLOCK_MONOTONIC_COARSE) is cheaper to read but only
+ * advances once per kernel tick, typically 1-4ms; timers and timeouts are
+ * then only as precise as that tick.
+ */
+pcomm_result_t pcomm_set_coarse_clock( pcomm_context_t *context, int coarse );
+int pcomm_get_coarse_clock( pcomm_context_t *context );
+
+/* Busy polling trades a core for wake-up latency: instead of sleeping in
+ * select the loop keeps polling with a zero timeout for a while after each
+ * event. The spin lasts about twice the recent gap between events and at
+ * most 'max_spin_us'; once events arrive further apart than that the loop
+ * sleeps as usual. 0 turns busy polling off.
+ */
+pcomm_result_t pcomm_set_busy_poll( pcomm_context_t *context, uint64_t max_spin_us );
+uint64_t pcomm_get_busy_poll( pcomm_context_t *context );
+
+/* interrupt a blocked select; safe to call from any thread */
+pcomm_result_t pcomm_wakeup( pcomm_context_t *context );
+
+/* Run callback(context, arg) on the loop thread. Safe to call from any
+ * thread; the loop is only woken if it is waiting in select. Tasks still
+ * queued when the context is destroyed are discarded without being run.
+ */
+pcomm_result_t pcomm_post( pcomm_context_t *context, pcomm_callback_task callback, void *arg );
+
+/* Start (or resize) the offload pool. pcomm_offload starts one worker per
+ * online CPU if this was never called.
+ */
+pcomm_result_t pcomm_set_offload_threads( pcomm_context_t *context, size_t threads );
+
+/* Run job_callback(arg) on an offload worker, then done_callback(context, arg)
+ * back on the loop thread. Call from the loop thread; the loop stays alive
+ * until every completion has run.
+ */
+pcomm_result_t pcomm_offload( pcomm_context_t *context, pcomm_callback_job job_callback,
+                              pcomm_callback_task done_callback, void *arg );
+
+/* Copy out the loop counters. They are plain counters owned by the loop
+ * thread, so read them from a callback or once the loop has stopped; reset
+ * starts a new measurement window at the current time.
+ */
+pcomm_result_t pcomm_get_stats( pcomm_context_t *context, pcomm_stats_t *stats );
+pcomm_result_t pcomm_reset_stats( pcomm_context_t *context );
+
+/* Latency histograms cost two clock reads around every callback, select and
+ * loop pass, and about 40KB per context; they are off until enabled.
+ * Disabling them drops what was recorded.
+ */
+pcomm_result_t pcomm_set_histograms( pcomm_context_t *context, int enabled );
+pcomm_result_t pcomm_get_histogram( pcomm_context_t *context, pcomm_hist_t which,
+                                    pcomm_histogram_t *histogram );
+pcomm_result_t pcomm_reset_histograms( pcomm_context_t *context );
+
+/* Histogram helpers, usable on any pcomm_histogram_t. The percentile (0-100)
+ * is reported as the top of the bucket it falls in, capped at the maximum.
+ */
+void pcomm_histogram_record( pcomm_histogram_t *histogram, uint64_t value );
+uint64_t pcomm_histogram_percentile( const pcomm_histogram_t *histogram, double percentile );
+
+/* A watchdog thread reports any loop pass (not counting time blocked in
+ * select) that runs longer than threshold_ms: which callback and descriptor
+ * were running and a backtrace of the loop thread, taken by interrupting it
+ * with PCOMM_WATCHDOG_SIGNAL. Each stall is reported once. With a NULL
+ * callback the report goes to stderr. A threshold of 0 stops the watchdog.
+ * The signal's previous handler is restored once no watchdog is running.
+ * A thread captures backtraces for one watched loop at a time: while a
+ * watched loop runs inside another's callback, and after it returns, the
+ * outer loop's stalls are reported without a backtrace.
+ */
+#define PCOMM_WATCHDOG_SIGNAL (SIGRTMIN + 7)
+
+pcomm_result_t pcomm_set_watchdog( pcomm_context_t *context, uint64_t threshold_ms,
+                                   pcomm_callback_stall stall_callback );
+
+/* a persistent context keeps its loop running when no descriptors, timers
+ * or tasks are registered, waiting for work to be posted to it */
+pcomm_result_t pcomm_set_persistent( pcomm_context_t *context, int persistent );
+
 /* used to maintain an external context relevant to the parent program */
 pcomm_result_t pcomm_set_external_context( pcomm_context_t *context, void *external_context );
 void *pcomm_get_external_context( pcomm_context_t *context );
 
-/* set debug mode for pcomm */
+/* Event tracing into an in-memory ring of at least the given number of
+ * records (rounded up to a power of two); 0 turns it off. Change it from
+ * the loop thread or while the loop is not running. Dump copies out up to
+ * n of the most recent records, oldest first, and may be called from any
+ * thread; records overwritten while copying are left out. Write sends the
+ * whole ring to a descriptor for the pcomm_trace decoder.
+ */
+pcomm_result_t pcomm_set_trace( pcomm_context_t *context, size_t records );
+size_t pcomm_trace_dump( pcomm_context_t *context, pcomm_trace_record_t *records, size_t n );
+pcomm_result_t pcomm_trace_write( pcomm_context_t *context, int fd );
+const char *pcomm_trace_name( pcomm_trace_event_t event );
+
+/* set debug mode for pcomm; this traces into a PCOMM_TRACE_DEFAULT ring
+ * unless a trace is already set */
 void pcomm_set_debug( pcomm_context_t *context, int on );
 int pcomm_get_debug( pcomm_context_t *context );
 
@@ -188,6 +685,16 @@ pcomm_result_t pcomm_set_external_fd_context( pcomm_context_t *context, pcomm_st
                                             int fd, void *external_fd_context );
 void *pcomm_get_external_fd_context( pcomm_context_t *context, pcomm_stream_t type, int fd );
 
+/* copy out the I/O counters of one descriptor */
+pcomm_result_t pcomm_get_fd_stats( pcomm_context_t *context, pcomm_stream_t type,
+                                   int fd, pcomm_fd_stats_t *stats );
+
+/* Fill 'top' with up to 'n' descriptors, across all three lists, with the
+ * highest value of 'metric', heaviest first. Returns how many were filled.
+ */
+size_t pcomm_top_fds( pcomm_context_t *context, pcomm_fd_metric_t metric,
+                      pcomm_fd_rank_t *top, size_t n );
+
 /* sets the function to be called immediately before select is called */
 pcomm_result_t pcomm_set_prepare_callback( pcomm_context_t *context,
                                            pcomm_callback_routine prepare_callback );
@@ -208,6 +715,22 @@ pcomm_result_t pcomm_set_timeout_callback( pcomm_context_t *context,
 /* changes the timeout for the select operation */
 pcomm_result_t pcomm_set_timeout( pcomm_context_t *context, struct timeval *timeout );
 
+/* schedule a timer to fire after timeout_ms milliseconds, and then every
+ * interval_ms milliseconds if interval_ms is non-zero. If timer is not NULL
+ * the handle remains valid until pcomm_timer_cancel or pcomm_destroy;
+ * otherwise a one-shot timer is released as soon as it has fired.
+ */
+pcomm_result_t pcomm_timer_add( pcomm_context_t *context, uint64_t timeout_ms,
+                                uint64_t interval_ms, pcomm_callback_timer callback,
+                                void *arg, pcomm_timer_t **timer );
+
+/* stop a timer and release its handle */
+pcomm_result_t pcomm_timer_cancel( pcomm_context_t *context, pcomm_timer_t *timer );
+
+/* re-arm a timer (active or not) to fire timeout_ms milliseconds from now */
+pcomm_result_t pcomm_timer_reset( pcomm_context_t *context, pcomm_timer_t *timer,
+                                  uint64_t timeout_ms );
+
 /* sets the maximum number of bytes to read before returning control to 
  * the select
  */
@@ -241,10 +764,72 @@ pcomm_result_t pcomm_monitor_read_fd( pcomm_context_t *context, int fd,
 pcomm_result_t pcomm_monitor_error_fd( pcomm_context_t *context, int fd,
                                        pcomm_callback_ready ready_callback );
 
+/* Create a CLOCK_MONOTONIC timer descriptor and add it to the READ list.
+ * The first expiration is after 'initial' and then every 'interval' (if
+ * interval is NULL or zero the timer is one-shot). The kernel keeps the
+ * schedule, so periodic timers do not drift with loop load. The new
+ * descriptor is stored in fd; it is closed on removal or pcomm_destroy.
+ */
+pcomm_result_t pcomm_add_timer_fd( pcomm_context_t *context,
+                                   const struct timespec *initial,
+                                   const struct timespec *interval,
+                                   pcomm_callback_expired expired_callback,
+                                   int *fd );
+pcomm_result_t pcomm_remove_timer_fd( pcomm_context_t *context, int fd );
+
+/* Deliver a signal as a loop event instead of through a handler. The signal
+ * is blocked in the calling thread, which should be the one running the
+ * loop; block it in every other thread too (before creating them) so the
+ * kernel queues it for the signalfd rather than acting on it. Signals that
+ * arrive together are read in one batch, and standard signals sent again
+ * before the loop reads them coalesce into one call.
+ */
+pcomm_result_t pcomm_add_signal( pcomm_context_t *context, int signo,
+                                 pcomm_callback_signal signal_callback );
+pcomm_result_t pcomm_remove_signal( pcomm_context_t *context, int signo );
+
+/* Evict a descriptor that has seen no activity for timeout_ms milliseconds,
+ * or that has been registered for longer than lifetime_ms milliseconds.
+ * Eviction removes the descriptor and calls its close_callback. Both
+ * timers live in the descriptor context and share the context's timer
+ * wheel; a value of zero disarms them.
+ */
+pcomm_result_t pcomm_set_fd_idle_timeout( pcomm_context_t *context, pcomm_stream_t type,
+                                          int fd, uint64_t timeout_ms );
+pcomm_result_t pcomm_set_fd_deadline( pcomm_context_t *context, pcomm_stream_t type,
+                                      int fd, uint64_t lifetime_ms );
+
 pcomm_result_t pcomm_remove_read_fd(  pcomm_context_t *context, int fd );
 pcomm_result_t pcomm_remove_write_fd( pcomm_context_t *context, int fd );
 pcomm_result_t pcomm_remove_error_fd( pcomm_context_t *context, int fd );
 
+/* Reactor groups: 'size' persistent, blocking contexts, each with its own
+ * registry and buffers. Configure them through pcomm_group_context before
+ * pcomm_group_start; once started, a context may only be touched from its
+ * own thread or through pcomm_post.
+ */
+pcomm_result_t pcomm_group_init( pcomm_group_t *group, size_t size );
+pcomm_result_t pcomm_group_destroy( pcomm_group_t *group );
+pcomm_context_t *pcomm_group_context( pcomm_group_t *group, size_t index );
+pcomm_result_t pcomm_group_start( pcomm_group_t *group );
+pcomm_result_t pcomm_group_stop( pcomm_group_t *group, int immediately );
+pcomm_result_t pcomm_group_join( pcomm_group_t *group );
+
+/* Open one SO_REUSEPORT listening socket per context, all bound to addr, so
+ * the kernel shards incoming connections. accept_callback runs on the
+ * owning context's thread when its listener is readable. If addr has port
+ * 0 the port chosen for the first socket is reused for the rest.
+ */
+pcomm_result_t pcomm_group_listen( pcomm_group_t *group, const struct sockaddr *addr,
+                                   socklen_t addrlen, int backlog,
+                                   pcomm_callback_ready accept_callback );
+
+/* hand an already connected descriptor to the next context in turn, which
+ * adds it to its READ list from its own thread */
+pcomm_result_t pcomm_group_dispatch_fd( pcomm_group_t *group, int fd,
+                                        pcomm_callback_io io_callback,
+                                        pcomm_callback_ready close_callback );
+
 /* convert a pcomm_result_t value into its string representation */
 const char* pcomm_strresult(pcomm_result_t result);
 
@@ -0,0 +1,42 @@
+/*
+ *  PComm static probes
+ *
+ *  USDT probe points for eBPF and SystemTap tools, provider "pcomm":
+ *
+ *      iteration__start(context)
+ *      iteration__end(context, result)
+ *      wait__start(context, max_fd)
+ *      wait__end(context, ready)              ready is select's return value
+ *      fd__dispatch(context, fd, stream)
+ *      read(context, fd, bytes)
+ *      write(context, fd, bytes)
+ *      callback__entry(context, kind, fd)     kind is a pcomm_hist_t
+ *      callback__return(context, kind, ns)    ns is 0 unless histograms are on
+ *
+ *  e.g. bpftrace -e 'usdt:./app:pcomm:wait__end { @[arg1] = count(); }'
+ *
+ *  Built against <sys/sdt.h> when it is available, each probe is a single
+ *  nop plus an ELF note until a tracer attaches. Without it, or with
+ *  PCOMM_NO_PROBES defined, the probes compile away entirely.
+ */
+#ifndef __PCOMM_PROBES_H__
+#define __PCOMM_PROBES_H__
+
+#if !defined(PCOMM_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PCOMM_HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef PCOMM_HAVE_PROBES
+#define PCOMM_PROBE1(name, a)         DTRACE_PROBE1(pcomm, name, a)
+#define PCOMM_PROBE2(name, a, b)      DTRACE_PROBE2(pcomm, name, a, b)
+#define PCOMM_PROBE3(name, a, b, c)   DTRACE_PROBE3(pcomm, name, a, b, c)
+#else
+#define PCOMM_PROBE1(name, a)         do { } while (0)
+#define PCOMM_PROBE2(name, a, b)      do { } while (0)
+#define PCOMM_PROBE3(name, a, b, c)   do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,71 @@
+/*
+ *  PComm trace decoder
+ *
+ *  Prints a trace written by pcomm_trace_write, one event per line:
+ *
+ *      pcomm_trace [file]
+ *
+ *  reads standard input when no file is given.
+ */
+#include "pcomm.h"
+
+static const char *callback_names[PCOMM_HIST_COUNT] = {
+    "wait", "prepare", "select", "timeout", "io", "timer", "task", "signal", "loop"
+};
+
+int main( int argc, char **argv )
+{
+    pcomm_trace_header_t header;
+    pcomm_trace_record_t record;
+    FILE *input = stdin;
+    uint64_t first = 0;
+    uint64_t last = 0;
+    uint32_t i;
+
+    if ( (argc > 1) && !(input = fopen( argv[1], "rb" )) ) {
+        perror( argv[1] );
+        return 1;
+    }
+    if ( (fread( &header, sizeof(header), 1, input ) != 1) ||
+         (header.magic != PCOMM_TRACE_MAGIC) ) {
+        fprintf( stderr, "pcomm_trace: not a pcomm trace\n" );
+        return 1;
+    }
+    if ( (header.version != PCOMM_TRACE_VERSION) ||
+         (header.record_size != sizeof(pcomm_trace_record_t)) ) {
+        fprintf( stderr, "pcomm_trace: unsupported trace version %u\n", header.version );
+        return 1;
+    }
+
+    printf( "%14s %10s  %-13s %5s  %s\n", "time_us", "delta_us", "event", "fd", "value" );
+    for ( i = 0; i < header.count; i++ ) {
+        if ( fread( &record, sizeof(record), 1, input ) != 1 ) {
+            fprintf( stderr, "pcomm_trace: truncated after %u of %u records\n", i, header.count );
+            return 1;
+        }
+        if ( i == 0 ) {
+            first = last = record.ns;
+        }
+        printf( "%14.3f %10.3f  %-13s ", (record.ns - first) / 1000.0, (record.ns - last) / 1000.0,
+                pcomm_trace_name( (pcomm_trace_event_t)record.event ) );
+        if ( record.fd >= 0 ) {
+            printf( "%5d  ", record.fd );
+        } else {
+            printf( "%5s  ", "-" );
+        }
+        if ( (record.event == PCOMM_TRACE_CALLBACK) &&
+             (record.value >= 0) && (record.value < PCOMM_HIST_COUNT) ) {
+            printf( "%s\n", callback_names[record.value] );
+        } else if ( record.event == PCOMM_TRACE_IO_FAILED ) {
+            printf( "%s\n", pcomm_strresult( (pcomm_result_t)record.value ) );
+        } else {
+            printf( "%lld\n", (long long)record.value );
+        }
+        last = record.ns;
+    }
+    if ( input != stdin ) {
+        fclose( input );
+    }
+
+    return 0;
+}
@@ -1,10 +1,16 @@
 #include <assert.h>
 #include <inttypes.h>
 #include <math.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include "pcomm.h"
 #include "simclist.h"
@@ -159,6 +165,7 @@ void test_init(struct test_context *t) {
   test(t, "debug should be disabled post init", c->debug == 0);
   test(t, "exit_now should be false post init", c->exit_now == 0);
   test(t, "exit_request should be false post init", c->exit_request == 0);
+  test(t, "wakeup descriptor should be open post init", c->wake_fd >= 0);
 
   group(t, NULL);
 }
@@ -219,6 +226,1371 @@ void test_debug_mode(struct test_context *t) {
   pcomm_set_debug(c, 0);
   pcomm_set_debug(c, -256);
   test(t, "debug should be enabled by negative non-zero value", pcomm_get_debug(c) == 1);
+  test(t, "debug should trace into the default ring", c->trace.mask + 1 == PCOMM_TRACE_DEFAULT);
+  pcomm_destroy(c);
+
+  group(t, NULL);
+}
+
+// Records timer expirations, stopping the loop once a limit is reached.
+struct timer_probe {
+  int fired;
+  int limit;
+  int64_t fired_at;
+};
+
+void on_probe_timer(pcomm_context_t *context, pcomm_timer_t *timer, void *arg) {
+  struct timer_probe *probe = (struct timer_probe *)arg;
+
+  probe->fired++;
+  probe->fired_at = get_nano_timestamp();
+  if (probe->limit > 0 && probe->fired >= probe->limit) {
+    pcomm_stop(context, 1);
+  }
+}
+
+void test_timers(struct test_context *t) {
+  pcomm_context_t context;
+  pcomm_context_t *c = &context;
+  pcomm_timer_t *handle = NULL;
+  struct timer_probe once = { .fired = 0, .limit = 1 };
+  struct timer_probe periodic = { .fired = 0, .limit = 3 };
+  struct timer_probe cancelled = { .fired = 0, .limit = 0 };
+  struct timer_probe far = { .fired = 0, .limit = 1 };
+  int64_t start;
+
+  group(t, "timers");
+
+  pcomm_init(c);
+  test(t, "no timers scheduled post init", c->timers.count == 0);
+  test(t, "add requires a callback",
+      pcomm_timer_add(c, 10, 0, NULL, NULL, NULL) == PCOMM_NULL_CALLBACK);
+  test(t, "cancel requires a timer", pcomm_timer_cancel(c, NULL) == PCOMM_NULL_TIMER);
+
+  start = get_nano_timestamp();
+  pcomm_timer_add(c, 20, 0, on_probe_timer, &once, NULL);
+  test(t, "one-shot timer is scheduled", c->timers.count == 1);
+  pcomm_main(c);
+  test(t, "one-shot timer fired once", once.fired == 1);
+  test(t, "one-shot timer did not fire early", once.fired_at - start >= 20 * MILLISECOND);
+  test(t, "detached one-shot timer was released", c->timers.count == 0 && c->timers.idle == NULL);
+  pcomm_destroy(c);
+
+  pcomm_init(c);
+  pcomm_timer_add(c, 5, 5, on_probe_timer, &periodic, NULL);
+  pcomm_main(c);
+  test(t, "periodic timer fired repeatedly", periodic.fired == 3);
+  pcomm_destroy(c);
+
+  pcomm_init(c);
+  pcomm_timer_add(c, 10, 0, on_probe_timer, &cancelled, &handle);
+  pcomm_timer_cancel(c, handle);
+  once.fired = 0;
+  pcomm_timer_add(c, 30, 0, on_probe_timer, &once, NULL);
+  pcomm_main(c);
+  test(t, "cancelled timer did not fire", cancelled.fired == 0);
+  pcomm_destroy(c);
+
+  pcomm_init(c);
+  once.fired = 0;
+  start = get_nano_timestamp();
+  pcomm_timer_add(c, 10, 0, on_probe_timer, &once, &handle);
+  pcomm_timer_reset(c, handle, 60);
+  pcomm_main(c);
+  test(t, "reset timer fired once", once.fired == 1);
+  test(t, "reset timer fired at its new deadline", once.fired_at - start >= 60 * MILLISECOND);
+  test(t, "fired timer with a handle is kept idle", c->timers.idle == handle);
+  pcomm_destroy(c);
+
+  pcomm_init(c);
+  start = get_nano_timestamp();
+  pcomm_timer_add(c, 300, 0, on_probe_timer, &far, NULL);
+  test(t, "timer beyond the first level is cascaded", c->timers.count == 1);
+  pcomm_main(c);
+  test(t, "cascaded timer fired once", far.fired == 1);
+  test(t, "cascaded timer did not fire early", far.fired_at - start >= 300 * MILLISECOND);
+  pcomm_destroy(c);
+
+  group(t, NULL);
+}
+
+// Counts loop iterations through the prepare callback.
+int prepare_count = 0;
+int prepare_limit = 0;
+
+void on_count_prepare(pcomm_context_t *context) {
+  prepare_count++;
+  if (prepare_limit > 0 && prepare_count >= prepare_limit) {
+    pcomm_stop(context, 1);
+  }
+}
+
+// Counts select wakeups that reported ready descriptors.
+int select_count = 0;
+
+void on_count_select(pcomm_context_t *context) {
+  select_count++;
+}
+
+void on_ignore_ready(pcomm_context_t *context, int fd) {
+}
+
+void test_blocking(struct test_context *t) {
+  pcomm_context_t context;
+  pcomm_context_t *c = &context;
+  struct timer_probe once = { .fired = 0, .limit = 1 };
+  struct timer_probe guard = { .fired = 0, .limit = 1 };
+  int64_t start;
+  int pipe_fds[2];
+
+  group(t, "blocking mode");
+
+  pcomm_init(c);
+  test(t, "blocking should be disabled by default", pcomm_get_blocking(c) == 0);
+
+  pcomm_set_blocking(c, 1);
+  test(t, "blocking should be enabled by value 1", pcomm_get_blocking(c) == 1);
+
+  prepare_count = 0;
+  prepare_limit = 0;
+  pcomm_set_prepare_callback(c, on_count_prepare);
+  pcomm_timer_add(c, 50, 0, on_probe_timer, &once, NULL);
+  pcomm_main(c);
+  test(t, "idle loop waits for the next deadline instead of spinning", prepare_count <= 3);
+  test(t, "timer fires while blocked", once.fired == 1);
+  pcomm_destroy(c);
+
+  pcomm_init(c);
+  pcomm_set_blocking(c, 1);
+  pipe(pipe_fds);
+  pcomm_monitor_read_fd(c, pipe_fds[0], on_ignore_ready);
+  prepare_count = 0;
+  prepare_limit = 2;
+  select_count = 0;
+  pcomm_set_prepare_callback(c, on_count_prepare);
+  pcomm_set_select_callback(c, on_count_select);
+  pcomm_timer_add(c, 2000, 0, on_probe_timer, &guard, NULL);
+  start = get_nano_timestamp();
+  pcomm_wakeup(c);
+  pcomm_main(c);
+  test(t, "wakeup interrupts a blocked select", get_nano_timestamp() - start < 1 * SECOND);
+  test(t, "wakeup is not reported as an event", select_count == 0 && guard.fired == 0);
+  pcomm_destroy(c);
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+
+  group(t, NULL);
+}
+
+// Records the loop clock as seen by callbacks in the same iteration.
+struct {
+  uint64_t first;
+  uint64_t second;
+  uint64_t later;
+  int calls;
+} clock_probe;
+
+void on_clock_timer(pcomm_context_t *context, pcomm_timer_t *timer, void *arg) {
+  struct timespec work = { .tv_sec = 0, .tv_nsec = 2 * MILLISECOND };
+
+  // the first expiry reads the clock around some work, the next one runs
+  // in a later iteration with a new sample
+  if (clock_probe.calls++ == 0) {
+    clock_probe.first = pcomm_now(context);
+    nanosleep(&work, NULL);
+    clock_probe.second = pcomm_now(context);
+  } else {
+    clock_probe.later = pcomm_now(context);
+    pcomm_stop(context, 1);
+  }
+}
+
+void test_clock(struct test_context *t) {
+  pcomm_context_t context;
+  pcomm_context_t *c = &context;
+  uint64_t before;
+
+  group(t, "loop clock");
+
+  memset(&clock_probe, 0, sizeof(clock_probe));
+
+  pcomm_init(c);
+  test(t, "no clock without a context", pcomm_now(NULL) == 0);
+  before = pcomm_now(c);
+  test(t, "clock is read fresh outside the loop", before > 0 && pcomm_now(c) >= before);
+  test(t, "coarse clock should be disabled by default", pcomm_get_coarse_clock(c) == 0);
+
+  pcomm_timer_add(c, 1, 1, on_clock_timer, NULL, NULL);
+  pcomm_main(c);
+  test(t, "callbacks in one iteration share a sample", clock_probe.first == clock_probe.second);
+  test(t, "the sample advances between iterations", clock_probe.later > clock_probe.first);
+  pcomm_destroy(c);
+
+  pcomm_init(c);
+  test(t, "coarse clock can be enabled", pcomm_set_coarse_clock(c, 1) == PCOMM_SUCCESS);
+  test(t, "coarse clock should be enabled by value 1", pcomm_get_coarse_clock(c) == 1);
+  before = pcomm_now(c);
+  usleep(20000);
+  test(t, "coarse clock advances", pcomm_now(c) > before);
+  pcomm_destroy(c);
+
+  group(t, NULL);
+}
+
+// Counts signals delivered through the loop.
+struct {
+  int calls;
+  int last;
+  int limit;
+} signals_seen;
+
+void on_signal(pcomm_context_t *context, int signo, const struct signalfd_siginfo *info) {
+  signals_seen.calls++;
+  signals_seen.last = (int)info->ssi_signo;
+  if (signals_seen.calls >= signals_seen.limit) {
+    pcomm_stop(context, 1);
+  }
+}
+
+void on_interrupt(int signo) {
+}
+
+void *interrupt_thread(void *arg) {
+  struct timespec pause = { .tv_sec = 0, .tv_nsec = 20 * MILLISECOND };
+
+  nanosleep(&pause, NULL);
+  pthread_kill(*(pthread_t *)arg, SIGUSR2);
+  return NULL;
+}
+
+void test_signals(struct test_context *t) {
+  pcomm_context_t context;
+  pcomm_context_t *c = &context;
+  struct timer_probe once = { .fired = 0, .limit = 1 };
+  struct sigaction action;
+  struct sigaction previous;
+  pthread_t self = pthread_self();
+  pthread_t interrupter;
+  sigset_t mask;
+  int i;
+
+  group(t, "signals");
+
+  // a signal with a plain handler must not end the loop
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = on_interrupt;
+  sigaction(SIGUSR2, &action, &previous);
+  pcomm_init(c);
+  pcomm_set_blocking(c, 1);
+  pcomm_timer_add(c, 100, 0, on_probe_timer, &once, NULL);
+  pthread_create(&interrupter, NULL, interrupt_thread, &self);
+  test(t, "loop survives an interrupted select", pcomm_main(c) == PCOMM_SUCCESS);
+  test(t, "timers still fire after the interrupt", once.fired == 1);
+  pthread_join(interrupter, NULL);
+  pcomm_destroy(c);
+  sigaction(SIGUSR2, &previous, NULL);
+
+  memset(&signals_seen, 0, sizeof(signals_seen));
+  pcomm_init(c);
+  test(t, "no signal descriptor post init", c->signal_fd < 0);
+  test(t, "signal numbers are checked", pcomm_add_signal(c, 0, on_signal) == PCOMM_INVALID_SIGNAL);
+  test(t, "SIGKILL cannot be routed", pcomm_add_signal(c, SIGKILL, on_signal) == PCOMM_INVALID_SIGNAL);
+  test(t, "a callback is required", pcomm_add_signal(c, SIGUSR1, NULL) == PCOMM_NULL_CALLBACK);
+  test(t, "a signal can be added", pcomm_add_signal(c, SIGUSR1, on_signal) == PCOMM_SUCCESS);
+  test(t, "signal descriptor is open", c->signal_fd >= 0);
+  pthread_sigmask(SIG_BLOCK, NULL, &mask);
+  test(t, "the signal is blocked", sigismember(&mask, SIGUSR1));
+
+  signals_seen.limit = 1;
+  pthread_kill(self, SIGUSR1);
+  pcomm_main(c);
+  test(t, "signal is delivered as a loop event", signals_seen.calls == 1 && signals_seen.last == SIGUSR1);
+  pcomm_destroy(c);
+  pthread_sigmask(SIG_BLOCK, NULL, &mask);
+  test(t, "destroy unblocks the signal", !sigismember(&mask, SIGUSR1));
+
+  // queued real-time signals arrive as one batch
+  memset(&signals_seen, 0, sizeof(signals_seen));
+  pcomm_init(c);
+  pcomm_add_signal(c, SIGRTMIN, on_signal);
+  for (i = 0; i < 5; i++) {
+    pthread_kill(self, SIGRTMIN);
+  }
+  signals_seen.limit = 5;
+  prepare_count = 0;
+  prepare_limit = 0;
+  pcomm_set_prepare_callback(c, on_count_prepare);
+  pcomm_main(c);
+  test(t, "every queued signal is delivered", signals_seen.calls == 5);
+  test(t, "a batch costs one pass of the loop", prepare_count == 1);
+  test(t, "a signal can be removed", pcomm_remove_signal(c, SIGRTMIN) == PCOMM_SUCCESS);
+  test(t, "removing the last signal closes the descriptor", c->signal_fd < 0);
+  test(t, "removing twice is reported", pcomm_remove_signal(c, SIGRTMIN) == PCOMM_FD_NOT_FOUND);
+  pcomm_destroy(c);
+
+  group(t, NULL);
+}
+
+int ready_count = 0;
+int post_count = 0;
+
+void on_count_post(pcomm_context_t *context, void *arg) {
+  post_count++;
+}
+
+void on_count_ready(pcomm_context_t *context, int fd) {
+  char byte;
+
+  read(fd, &byte, 1);
+  ready_count++;
+}
+
+void *post_later_thread(void *arg) {
+  struct timespec pause = { .tv_sec = 0, .tv_nsec = 10 * MILLISECOND };
+
+  nanosleep(&pause, NULL);
+  pcomm_post((pcomm_context_t *)arg, on_count_post, NULL);
+  return NULL;
+}
+
+// Whether the backend descriptor turns readable within timeout_ms.
+int backend_ready(int fd, int timeout_ms) {
+  struct pollfd entry = { .fd = fd, .events = POLLIN, .revents = 0 };
+  return poll(&entry, 1, timeout_ms) == 1;
+}
+
+void test_run_once(struct test_context *t) {
+  pcomm_context_t context;
+  pcomm_context_t *c = &context;
+  struct timer_probe once = { .fired = 0, .limit = 0 };
+  pthread_t poster;
+  int pipe_fds[2];
+  int backend;
+
+  group(t, "single-step api");
+
+  pcomm_init(c);
+  test(t, "run_once requires a context", pcomm_run_once(NULL, 0) == PCOMM_NULL_CONTEXT);
+  test(t, "an empty context has nothing to wait for", pcomm_run_once(c, 0) == PCOMM_FD_NOT_FOUND);
+  test(t, "an empty pass does not stop the context", c->exit_now == 0);
+  test(t, "no backend descriptor before it is asked for", c->backend_fd < 0);
+
+  pipe(pipe_fds);
+  ready_count = 0;
+  pcomm_monitor_read_fd(c, pipe_fds[0], on_count_ready);
+  backend = pcomm_get_backend_fd(c);
+  test(t, "backend descriptor is created on demand", backend >= 0);
+  test(t, "backend is quiet while nothing is ready", !backend_ready(backend, 0));
+  write(pipe_fds[1], "x", 1);
+  test(t, "backend is readable once a descriptor is", backend_ready(backend, 1000));
+  test(t, "run_once dispatches the ready descriptor", pcomm_run_once(c, 0) == PCOMM_SUCCESS && ready_count == 1);
+  test(t, "backend is quiet again after the pass", !backend_ready(backend, 0));
+
+  pcomm_timer_add(c, 20, 0, on_probe_timer, &once, NULL);
+  pcomm_run_once(c, 0);
+  test(t, "backend becomes readable when a timer is due", backend_ready(backend, 1000));
+  pcomm_run_once(c, 0);
+  test(t, "run_once runs the due timer", once.fired == 1);
+
+  post_count = 0;
+  pthread_create(&poster, NULL, post_later_thread, c);
+  test(t, "backend becomes readable when a task is posted", backend_ready(backend, 1000));
+  pthread_join(poster, NULL);
+  pcomm_run_once(c, 0);
+  test(t, "run_once runs the posted task", post_count == 1);
+
+  // a wakeup that lands as a timer comes due must not hold the timer back
+  pcomm_timer_add(c, 5, 0, on_probe_timer, &once, NULL);
+  nanosleep(&(struct timespec){ .tv_sec = 0, .tv_nsec = 10 * MILLISECOND }, NULL);
+  pcomm_wakeup(c);
+  pcomm_run_once(c, 0);
+  test(t, "a wakeup pass also runs due timers", once.fired == 2);
+
+  test(t, "a timeout bounds the wait", pcomm_run_once(c, 10) == PCOMM_SUCCESS);
+  pcomm_stop(c, 1);
+  test(t, "a stopped context reports exiting", pcomm_run_once(c, 0) == PCOMM_EXITING);
+  pcomm_destroy(c);
+  test(t, "backend is closed post destroy", c->backend_fd < 0);
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+
+  group(t, NULL);
+}
+
+size_t stats_read = 0;
+
+void on_stats_read(pcomm_context_t *context, int fd, uint8_t *data, size_t length) {
+  stats_read += length;
+}
+
+void test_stats(struct test_context *t) {
+  pcomm_context_t context;
+  pcomm_context_t *c = &context;
+  struct timer_probe once = { .fired = 0, .limit = 1 };
+  pcomm_stats_t stats;
+  int pipe_fds[2];
+
+  group(t, "loop statistics");
+
+  pcomm_init(c);
+  test(t, "stats require a destination", pcomm_get_stats(c, NULL) == PCOMM_NULL_BUFFER);
+  pcomm_get_stats(c, &stats);
+  test(t, "counters start at zero", stats.iterations == 0 && stats.bytes_read == 0);
+  test(t, "the window starts at init", stats.since > 0);
+
+  pipe(pipe_fds);
+  stats_read = 0;
+  post_count = 0;
+  // the timer ends the run well after the message has gone through
+  pcomm_timer_add(c, 20, 0, on_probe_timer, &once, NULL);
+  pcomm_post(c, on_count_post, NULL);
+  pcomm_add_read_fd(c, pipe_fds[0], on_stats_read, NULL);
+  pcomm_add_write_fd(c, pipe_fds[1], (uint8_t *)"hello", 5, NULL, NULL);
+  pcomm_main(c);
+
+  pcomm_get_stats(c, &stats);
+  test(t, "iterations are counted", stats.iterations > 0);
+  test(t, "every select return is classified",
+       stats.iterations == stats.wakeups + stats.timeouts + stats.interrupts);
+  test(t, "ready descriptors are summed", stats.ready_fds >= stats.wakeups && stats.max_ready_fds > 0);
+  test(t, "bytes written are counted", stats.writes == 1 && stats.bytes_written == 5);
+  test(t, "bytes read are counted", stats.reads > 0 && stats.bytes_read == 5);
+  test(t, "fired timers are counted", stats.timers_fired == 1);
+  test(t, "posted tasks are counted", stats.tasks_run == 1);
+
+  test(t, "stats can be reset", pcomm_reset_stats(c) == PCOMM_SUCCESS);
+  pcomm_get_stats(c, &stats);
+  test(t, "reset clears the counters", stats.iterations == 0 && stats.bytes_written == 0);
+  pcomm_destroy(c);
+  close(pipe_fds[0]);
+  close(pipe_fds[1]);
+
+  group(t, NULL);
+}
+
+void on_slow_timer(pcomm_context_t *context, pcomm_timer_t *timer, void *arg) {
+  struct timespec work = { .tv_sec = 0, .tv_nsec = 2 * MILLISECOND };
+
+  nanosleep(&work, NULL);
+  pcomm_stop(context, 1);
+}
+
+void test_histograms(struct test_context *t) {
+  pcomm_context_t context;
+  pcomm_context_t *c = &context;
+  pcomm_histogram_t *h = calloc(1, sizeof(pcomm_histogram_t));
+  uint64_t p50;
+  uint64_t v;
+
+  group(t, "latency histograms");
+
+  for (v = 1; v <= 1000; v++) {
+    pcomm_histogram_record(h, v);
+  }
+  p50 = pcomm_histogram_percentile(h, 50.0);
+  test(t, "values are counted", h->count == 1000 && h->min == 1 && h->max == 1000);
+  test(t, "median is within the bucket precision", p50 >= 500 && p50 <= 500 + 500 / 16);
+  test(t, "the top percentile is the maximum", pcomm_histogram_percentile(h, 100.0) == 1000);
+  test(t, "the zero percentile is the minimum", pcomm_histogram_percentile(h, 0.0) == 1);
+  memset(h, 0, sizeof(pcomm_histogram_t));
+  pcomm_histogram_record(h, 7);
+  test(t, "small values are exact", pcomm_histogram_percentile(h, 50.0) == 7);
+  pcomm_histogram_record(h, UINT64_MAX);
+  test(t, "huge values are kept in the last bucket", h->buckets[PCOMM_HIST_BUCKETS - 1] == 1 &&
+       pcomm_histogram_percentile(h, 100.0) == UINT64_MAX);
+  test(t, "an empty histogram reports zero", pcomm_histogram_percentile(NULL, 50.0) == 0);
+
+  pcomm_init(c);
+  test(t, "histograms should be disabled by default", c->histograms == NULL);
+  pcomm_get_histogram(c, PCOMM_HIST_WAIT, h);
+  test(t, "a disabled histogram reads as empty", h->count == 0);
+  test(t, "histogram kind is checked",
+       pcomm_get_histogram(c, PCOMM_HIST_COUNT, h) == PCOMM_INVALID_HISTOGRAM);
+  test(t, "histograms can be enabled", pcomm_set_histograms(c, 1) == PCOMM_SUCCESS);
+
+  pcomm_timer_add(c, 5, 0, on_slow_timer, NULL, NULL);
+  pcomm_main(c);
+  pcomm_get_histogram(c, PCOMM_HIST_TIMER, h);
+  test(t, "timer callbacks are timed", h->count == 1 && h->min >= 2 * MILLISECOND);
+  pcomm_get_histogram(c, PCOMM_HIST_WAIT, h);
+  test(t, "select waits are timed", h->count > 0);
+  pcomm_get_histogram(c, PCOMM_HIST_ITERATION, h);
+  test(t, "loop passes are timed", h->count > 0 && h->max >= 2 * MILLISECOND);
+  pcomm_reset_histograms(c);
+  pcomm_get_histogram(c, PCOMM_HIST_ITERATION, h);
+  test(t, "histograms can be reset", h->count == 0);
+  pcomm_destroy(c);
+  test(t, "histograms are freed post destroy", c->histograms == NULL);
+  free(h);
+
+  group(t, NULL);
+}
+
+// Ping-pong over a pair of pipes with an echo thread on the far end.
+#define PING_ROUNDS 200
+
+struct {
+  int to_echo[2];
+  int from_echo[2];
+  int rounds;
+  int64_t sent;
+  int64_t total;
+} pings;
+
+void *ping_echo_thread(void *arg) {
+  char byte;
+
+  while (read(pings.to_echo[0], &byte, 1) == 1) {
+    if (write(pings.from_echo[1], &byte, 1) != 1) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+void on_pong(pcomm_context_t *context, int fd) {
+  char byte;
+
+  read(fd, &byte, 1);
+  pings.total += get_nano_timestamp() - pings.sent;
+  if (++pings.rounds == PING_ROUNDS) {
+    pcomm_stop(context, 1);
+    return;
+  }
+  pings.sent = get_nano_timestamp();
+  write(pings.to_echo[1], &byte, 1);
+}
+
+// Runs PING_ROUNDS round trips and returns the loop iteration count.
+int ping_pong(pcomm_context_t *c) {
+  pthread_t echo;
+  char byte = 'p';
+
+  memset(&pings, 0, sizeof(pings));
+  pipe(pings.to_echo);
+  pipe(pings.from_echo);
+  pthread_create(&echo, NULL, ping_echo_thread, NULL);
+
+  prepare_count = 0;
+  prepare_limit = 0;
+  pcomm_set_prepare_callback(c, on_count_prepare);
+  pcomm_monitor_read_fd(c, pings.from_echo[0], on_pong);
+  pings.sent = get_nano_timestamp();
+  write(pings.to_echo[1], &byte, 1);
+  pcomm_main(c);
+
+  close(pings.to_echo[1]);
+  pthread_join(echo, NULL);
+  close(pings.to_echo[0]);
+  close(pings.from_echo[0]);
+  close(pings.from_echo[1]);
+  return prepare_count;
+}
+
+void test_busy_poll(struct test_context *t) {
+  pcomm_context_t context;
+  pcomm_context_t *c = &context;
+  struct timer_probe once = { .fired = 0, .limit = 1 };
+  int iterations;
+
+  group(t, "busy polling");
+
+  pcomm_init(c);
+  test(t, "busy polling should be disabled by default", pcomm_get_busy_poll(c) == 0);
+  test(t, "busy polling can be enabled", pcomm_set_busy_poll(c, 200) == PCOMM_SUCCESS);
+  test(t, "the spin bound is kept", pcomm_get_busy_poll(c) == 200);
+  pcomm_destroy(c);
+
+  pcomm_init(c);
+  pcomm_set_blocking(c, 1);
+  iterations = ping_pong(c);
+  test(t, "blocking ping-pong sleeps between round trips", iterations <= PING_ROUNDS * 2);
+  pcomm_destroy(c);
+
+  pcomm_init(c);
+  pcomm_set_blocking(c, 1);
+  pcomm_set_busy_poll(c, 1000);
+  iterations = ping_pong(c);
+  test(t, "busy-poll ping-pong completes", pings.rounds == PING_ROUNDS && iterations >= PING_ROUNDS);
+  pcomm_destroy(c);
+
+  // after the last event the loop spins for a while, then goes to sleep
+  pcomm_init(c);
+  pcomm_set_blocking(c, 1);
+  pcomm_set_busy_poll(c, 1000);
+  prepare_count = 0;
+  prepare_limit = 0;
+  pcomm_set_prepare_callback(c, on_count_prepare);
+  pcomm_timer_add(c, 50, 0, on_probe_timer, &once, NULL);
+  pcomm_main(c);
+  test(t, "a busy-poll loop spins right after activity", prepare_count > 3);
+  test(t, "an idle busy-poll loop falls back to blocking", once.fired == 1 && prepare_count < 50000);
+  pcomm_destroy(c);
+
+  group(t, NULL);
+}
+
+// Accumulates timer descriptor expirations.
+struct expiry_probe {
+  int calls;
+  uint64_t expirations;
+  uint64_t largest;
+  uint64_t limit;
+} expiry;
+
+void on_timer_fd(pcomm_context_t *context, int fd, uint64_t expirations) {
+  struct timespec busy = { .tv_sec = 0, .tv_nsec = 12 * MILLISECOND };
+
+  expiry.calls++;
+  expiry.expirations += expirations;
+  if (expirations > expiry.largest) {
+    expiry.largest = expirations;
+  }
+  // stall the loop once so the kernel has to count missed periods
+  if (expiry.calls == 1) {
+    nanosleep(&busy, NULL);
+  }
+  if (expiry.expirations >= expiry.limit) {
+    pcomm_remove_timer_fd(context, fd);
+  }
+}
+
+void test_timer_fds(struct test_context *t) {
+  pcomm_context_t context;
+  pcomm_context_t *c = &context;
+  struct timespec initial = { .tv_sec = 0, .tv_nsec = 2 * MILLISECOND };
+  struct timespec interval = { .tv_sec = 0, .tv_nsec = 2 * MILLISECOND };
+  int fd = -1;
+
+  group(t, "timer descriptors");
+
+  pcomm_init(c);
+  test(t, "add requires a callback",
+      pcomm_add_timer_fd(c, &initial, &interval, NULL, &fd) == PCOMM_NULL_CALLBACK);
+  test(t, "add succeeds with a callback",
+      pcomm_add_timer_fd(c, &initial, &interval, on_timer_fd, &fd) == PCOMM_SUCCESS);
+  test(t, "timer descriptor is registered for reading", list_size(&c->read_fds) == 1 && fd >= 0);
+
+  memset(&expiry, 0, sizeof(expiry));
+  expiry.limit = 10;
+  pcomm_main(c);
+  test(t, "expirations are delivered", expiry.expirations >= 10);
+  test(t, "missed periods are reported as a count", expiry.largest > 1);
+  test(t, "removal unregisters the timer descriptor", list_size(&c->read_fds) == 0);
+  test(t, "removing an unknown timer descriptor fails",
+      pcomm_remove_timer_fd(c, fd) == PCOMM_FD_NOT_FOUND);
+  pcomm_destroy(c);
+
+  group(t, NULL);
+}
+
+// Records evictions reported through the close callback.
+struct eviction_probe {
+  int fd;
+  int closed;
+  int64_t closed_at;
+} evictions[2];
+
+int bytes_seen = 0;
+
+void on_evicted(pcomm_context_t *context, int fd) {
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    if (evictions[i].fd == fd) {
+      evictions[i].closed++;
+      evictions[i].closed_at = get_nano_timestamp();
+    }
+  }
+}
+
+void on_ignore_io(pcomm_context_t *context, int fd, uint8_t *data, size_t length) {
+  bytes_seen += (int)length;
+}
+
+void on_poke_timer(pcomm_context_t *context, pcomm_timer_t *timer, void *arg) {
+  if (write(*(int *)arg, "x", 1) != 1) {
+    pcomm_stop(context, 1);
+  }
+}
+
+void test_fd_timeouts(struct test_context *t) {
+  pcomm_context_t context;
+  pcomm_context_t *c = &context;
+  int idle_pair[2];
+  int lifetime_pair[2];
+  int64_t start;
+
+  group(t, "descriptor timeouts");
+
+  socketpair(AF_UNIX, SOCK_STREAM, 0, idle_pair);
+  socketpair(AF_UNIX, SOCK_STREAM, 0, lifetime_pair);
+  memset(evictions, 0, sizeof(evictions));
+  evictions[0].fd = idle_pair[0];
+  evictions[1].fd = lifetime_pair[0];
+  bytes_seen = 0;
+
+  pcomm_init(c);
+  pcomm_set_blocking(c, 1);
+  pcomm_add_read_fd(c, idle_pair[0], on_ignore_io, on_evicted);
+  pcomm_add_read_fd(c, lifetime_pair[0], on_ignore_io, on_evicted);
+  test(t, "idle timeout requires a registered descriptor",
+      pcomm_set_fd_idle_timeout(c, PCOMM_STREAM_WRITE, idle_pair[0], 40) == PCOMM_FD_NOT_FOUND);
+  test(t, "idle timeout is set",
+      pcomm_set_fd_idle_timeout(c, PCOMM_STREAM_READ, idle_pair[0], 40) == PCOMM_SUCCESS);
+  test(t, "lifetime deadline is set",
+      pcomm_set_fd_deadline(c, PCOMM_STREAM_READ, lifetime_pair[0], 30) == PCOMM_SUCCESS);
+  test(t, "descriptor timers share the context wheel", c->timers.count == 2);
+
+  // traffic at 20ms postpones the idle eviction, but not the lifetime one
+  pcomm_timer_add(c, 20, 0, on_poke_timer, &idle_pair[1], NULL);
+  pcomm_timer_add(c, 20, 0, on_poke_timer, &lifetime_pair[1], NULL);
+  start = get_nano_timestamp();
+  pcomm_main(c);
+
+  test(t, "activity was delivered before eviction", bytes_seen == 2);
+  test(t, "idle descriptor was evicted once", evictions[0].closed == 1);
+  test(t, "activity pushed back the idle eviction",
+      evictions[0].closed_at - start >= 60 * MILLISECOND);
+  test(t, "lifetime descriptor was evicted once", evictions[1].closed == 1);
+  test(t, "lifetime eviction ignored activity",
+      evictions[1].closed_at - start >= 30 * MILLISECOND &&
+      evictions[1].closed_at < evictions[0].closed_at);
+  test(t, "evicted descriptors were removed", list_size(&c->read_fds) == 0);
+  test(t, "no descriptor timers left behind", c->timers.count == 0);
+  pcomm_destroy(c);
+
+  close(idle_pair[0]);
+  close(idle_pair[1]);
+  close(lifetime_pair[0]);
+  close(lifetime_pair[1]);
+
+  group(t, NULL);
+}
+
+// Removes its own descriptor, then reads the data it was handed.
+char removed_data[8];
+
+void on_remove_self(pcomm_context_t *context, int fd, uint8_t *data, size_t length) {
+  pcomm_remove_read_fd(context, fd);
+  memcpy(removed_data, data, length < sizeof(removed_data) ? length : sizeof(removed_data));
+}
+
+void on_remove_self_written(pcomm_context_t *context, int fd, uint8_t *data, size_t length) {
+  pcomm_remove_write_fd(context, fd);
+}
+
+void test_self_removal(struct test_context *t) {
+  pcomm_context_t context;
+  pcomm_context_t *c = &context;
+  int fds[2];
+  int i;
+
+  group(t, "removal from a callback");
+
+  pipe(fds);
+  memset(removed_data, 0, sizeof(removed_data));
+  pcomm_init(c);
+  pcomm_add_read_fd(c, fds[0], on_remove_self, NULL);
+  pcomm_add_write_fd(c, fds[1], (uint8_t *)"abc", 4, on_remove_self_written, NULL);
+  for (i = 0; (i < 10) && (list_size(&c->read_fds) || list_size(&c->write_fds)); i++) {
+    pcomm_run_once(c, 100);
+  }
+  test(t, "read callback removed its own descriptor", list_size(&c->read_fds) == 0);
+  test(t, "read data stayed valid after removal", !strcmp(removed_data, "abc"));
+  test(t, "write callback removed its own descriptor", list_size(&c->write_fds) == 0);
+  test(t, "removed contexts were released after dispatch", c->retired == NULL);
+  pcomm_destroy(c);
+
+  close(fds[0]);
+  close(fds[1]);
+
+  group(t, NULL);
+}
+
+int write_closes = 0;
+
+void on_write_closed(pcomm_context_t *context, int fd) {
+  write_closes++;
+}
+
+void test_write_failure(struct test_context *t) {
+  pcomm_context_t context;
+  pcomm_context_t *c = &context;
+  void (*previous)(int);
+  int pair[2];
+  int i;
+
+  group(t, "write failure");
+
+  // the peer is gone, so the write fails with EPIPE rather than a signal
+  previous = signal(SIGPIPE, SIG_IGN);
+  socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+  close(pair[1]);
+  write_closes = 0;
+  pcomm_init(c);
+  pcomm_add_write_fd(c, pair[0], (uint8_t *)"abc", 3, NULL, on_write_closed);
+  for (i = 0; (i < 10) && list_size(&c->write_fds); i++) {
+    pcomm_run_once(c, 100);
+  }
+  test(t, "failed write removed the descriptor", list_size(&c->write_fds) == 0);
+  test(t, "failed write called close_callback once", write_closes == 1);
+  pcomm_destroy(c);
+  close(pair[0]);
+  signal(SIGPIPE, previous);
+
+  group(t, NULL);
+}
+
+// Stops a context from another thread after a short delay.
+void *stop_from_thread(void *arg) {
+  struct timespec delay = { .tv_sec = 0, .tv_nsec = 30 * MILLISECOND };
+
+  nanosleep(&delay, NULL);
+  pcomm_stop((pcomm_context_t *)arg, 1);
+  return NULL;
+}
+
+void test_wakeup(struct test_context *t) {
+  pcomm_context_t context;
+  pcomm_context_t *c = &context;
+  struct timer_probe guard = { .fired = 0, .limit = 1 };
+  pthread_t stopper;
+  int64_t start;
+  int pipe_fds[2];
+
+  group(t, "wakeup");
+
+  pcomm_init(c);
+  test(t, "wakeup succeeds post init", pcomm_wakeup(c) == PCOMM_SUCCESS);
+  test(t, "repeated wakeups are coalesced", pcomm_wakeup(c) == PCOMM_SUCCESS && c->wake_pending == 1);
+  pcomm_destroy(c);
+  test(t, "wakeup descriptor is closed post destroy", c->wake_fd == -1);
+  test(t, "wakeup fails post destroy", pcomm_wakeup(c) == PCOMM_UNINITIALIZED_CONTEXT);
+
+  pcomm_init(c);
+  pcomm_set_blocking(c, 1);
+  if (pipe(pipe_fds) == 0) {
+    pcomm_monitor_read_fd(c, pipe_fds[0], on_ignore_ready);
+    pcomm_timer_add(c, 2000, 0, on_probe_timer, &guard, NULL);
+    start = get_nano_timestamp();
+    pthread_create(&stopper, NULL, stop_from_thread, c);
+    pcomm_main(c);
+    pthread_join(stopper, NULL);
+    test(t, "stop from another thread interrupts a blocked select",
+        get_nano_timestamp() - start < 1 * SECOND && guard.fired == 0);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+  }
+  pcomm_destroy(c);
+
+  group(t, NULL);
+}
+
+// Shared state for tasks posted by several producer threads.
+#define POST_PRODUCERS 4
+#define POST_PER_PRODUCER 20000
+
+struct post_state {
+  pcomm_context_t *context;
+  int received;
+  int out_of_order;
+  int last_seen[POST_PRODUCERS];
+} posts;
+
+void on_posted_task(pcomm_context_t *context, void *arg) {
+  intptr_t value = (intptr_t)arg;
+  int producer = (int)(value % POST_PRODUCERS);
+  int sequence = (int)(value / POST_PRODUCERS);
+
+  if (sequence != posts.last_seen[producer] + 1) {
+    posts.out_of_order++;
+  }
+  posts.last_seen[producer] = sequence;
+  if (++posts.received == POST_PRODUCERS * POST_PER_PRODUCER) {
+    pcomm_stop(context, 1);
+  }
+}
+
+void *post_from_thread(void *arg) {
+  intptr_t producer = (intptr_t)arg;
+  intptr_t sequence;
+
+  for (sequence = 0; sequence < POST_PER_PRODUCER; sequence++) {
+    pcomm_post(posts.context, on_posted_task, (void *)(sequence * POST_PRODUCERS + producer));
+  }
+  return NULL;
+}
+
+void test_post(struct test_context *t) {
+  pcomm_context_t context;
+  pcomm_context_t *c = &context;
+  struct timer_probe guard = { .fired = 0, .limit = 1 };
+  pthread_t producers[POST_PRODUCERS];
+  intptr_t i;
+
+  group(t, "posted tasks");
+
+  pcomm_init(c);
+  test(t, "post requires a callback", pcomm_post(c, NULL, NULL) == PCOMM_NULL_CALLBACK);
+
+  memset(&posts, 0, sizeof(posts));
+  for (i = 0; i < POST_PRODUCERS; i++) {
+    posts.last_seen[i] = -1;
+  }
+  posts.context = c;
+  pcomm_set_blocking(c, 1);
+  pcomm_timer_add(c, 10000, 0, on_probe_timer, &guard, NULL);
+  for (i = 0; i < POST_PRODUCERS; i++) {
+    pthread_create(&producers[i], NULL, post_from_thread, (void *)i);
+  }
+  pcomm_main(c);
+  for (i = 0; i < POST_PRODUCERS; i++) {
+    pthread_join(producers[i], NULL);
+  }
+  test(t, "every posted task ran on the loop",
+      posts.received == POST_PRODUCERS * POST_PER_PRODUCER && guard.fired == 0);
+  test(t, "tasks from one producer ran in order", posts.out_of_order == 0);
+  pcomm_destroy(c);
+
+  pcomm_init(c);
+  memset(&posts, 0, sizeof(posts));
+  pcomm_post(c, on_posted_task, (void *)0);
+  test(t, "a posted task keeps an otherwise empty loop alive",
+      pcomm_main(c) == PCOMM_FD_NOT_FOUND && posts.received == 1);
+  pcomm_post(c, on_posted_task, (void *)0);
+  pcomm_destroy(c);
+  test(t, "unrun tasks are released on destroy", posts.received == 1);
+
+  group(t, NULL);
+}
+
+// Connection and message counts across a reactor group.
+#define GROUP_SIZE 4
+#define GROUP_CONNECTIONS 32
+
+struct group_state {
+  pcomm_group_t *group;
+  int accepted[GROUP_SIZE];
+  int handled[GROUP_SIZE];
+  int total;
+} reactors;
+
+int group_index(pcomm_context_t *context) {
+  return (int)(context - reactors.group->contexts);
+}
+
+void on_group_accept(pcomm_context_t *context, int fd) {
+  int client;
+
+  while ((client = accept(fd, NULL, NULL)) >= 0) {
+    close(client);
+    reactors.accepted[group_index(context)]++;
+    __atomic_add_fetch(&reactors.total, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+void on_group_io(pcomm_context_t *context, int fd, uint8_t *data, size_t length) {
+  reactors.handled[group_index(context)]++;
+  __atomic_add_fetch(&reactors.total, 1, __ATOMIC_SEQ_CST);
+}
+
+void wait_for_total(int expected) {
+  struct timespec pause = { .tv_sec = 0, .tv_nsec = 1 * MILLISECOND };
+  int waited = 0;
+
+  while (__atomic_load_n(&reactors.total, __ATOMIC_SEQ_CST) < expected && waited++ < 2000) {
+    nanosleep(&pause, NULL);
+  }
+}
+
+void test_reactor_group(struct test_context *t) {
+  pcomm_group_t reactor_group;
+  struct sockaddr_in address;
+  socklen_t address_len = sizeof(address);
+  int clients[GROUP_CONNECTIONS];
+  int pairs[2 * GROUP_SIZE][2];
+  int busy = 0;
+  int balanced = 1;
+  int i;
+
+  group(t, "reactor group");
+
+  memset(&reactors, 0, sizeof(reactors));
+  reactors.group = &reactor_group;
+  test(t, "group init succeeds", pcomm_group_init(&reactor_group, GROUP_SIZE) == PCOMM_SUCCESS);
+  test(t, "group contexts are blocking and persistent",
+      pcomm_get_blocking(pcomm_group_context(&reactor_group, 0)) == 1 &&
+      pcomm_group_context(&reactor_group, 0)->persistent == 1);
+  test(t, "out of range context is NULL", pcomm_group_context(&reactor_group, GROUP_SIZE) == NULL);
+
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = 0;
+  test(t, "listeners open on every context",
+      pcomm_group_listen(&reactor_group, (struct sockaddr *)&address, sizeof(address), 64,
+                         on_group_accept) == PCOMM_SUCCESS);
+  getsockname(reactor_group.listen_fds[0], (struct sockaddr *)&address, &address_len);
+  test(t, "group starts", pcomm_group_start(&reactor_group) == PCOMM_SUCCESS);
+
+  for (i = 0; i < GROUP_CONNECTIONS; i++) {
+    clients[i] = socket(AF_INET, SOCK_STREAM, 0);
+    connect(clients[i], (struct sockaddr *)&address, sizeof(address));
+  }
+  wait_for_total(GROUP_CONNECTIONS);
+  for (i = 0; i < GROUP_SIZE; i++) {
+    busy += (reactors.accepted[i] > 0) ? 1 : 0;
+  }
+  test(t, "every connection was accepted", reactors.total == GROUP_CONNECTIONS);
+  test(t, "connections were sharded across contexts", busy > 1);
+  for (i = 0; i < GROUP_CONNECTIONS; i++) {
+    close(clients[i]);
+  }
+
+  reactors.total = 0;
+  for (i = 0; i < 2 * GROUP_SIZE; i++) {
+    socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[i]);
+    pcomm_group_dispatch_fd(&reactor_group, pairs[i][0], on_group_io, NULL);
+    if (write(pairs[i][1], "x", 1) != 1) {
+      balanced = 0;
+    }
+  }
+  wait_for_total(2 * GROUP_SIZE);
+  for (i = 0; i < GROUP_SIZE; i++) {
+    balanced = balanced && (reactors.handled[i] == 2);
+  }
+  test(t, "handed off descriptors are spread round-robin", balanced);
+
+  pcomm_group_stop(&reactor_group, 1);
+  test(t, "group joins cleanly", pcomm_group_join(&reactor_group) == PCOMM_SUCCESS);
+  pcomm_group_destroy(&reactor_group);
+  test(t, "group is empty post destroy", reactor_group.size == 0 && reactor_group.contexts == NULL);
+  for (i = 0; i < 2 * GROUP_SIZE; i++) {
+    close(pairs[i][0]);
+    close(pairs[i][1]);
+  }
+
+  group(t, NULL);
+}
+
+// Offloaded jobs and where their completions ran.
+#define OFFLOAD_JOBS 64
+
+struct offload_state {
+  pthread_t loop_thread;
+  int completed;
+  int off_loop;
+  int on_loop;
+  int results[OFFLOAD_JOBS];
+} offloads;
+
+void on_offload_job(void *arg) {
+  int *slot = (int *)arg;
+  struct timespec work = { .tv_sec = 0, .tv_nsec = 1 * MILLISECOND };
+
+  if (pthread_equal(pthread_self(), offloads.loop_thread)) {
+    __atomic_add_fetch(&offloads.on_loop, 1, __ATOMIC_SEQ_CST);
+  }
+  nanosleep(&work, NULL);
+  *slot = (int)(slot - offloads.results) * 2;
+}
+
+void on_offload_done(pcomm_context_t *context, void *arg) {
+  if (!pthread_equal(pthread_self(), offloads.loop_thread)) {
+    offloads.off_loop++;
+  }
+  // the periodic timer keeps the loop alive until the last completion
+  if (++offloads.completed == OFFLOAD_JOBS) {
+    pcomm_stop(context, 1);
+  }
+}
+
+void test_offload(struct test_context *t) {
+  pcomm_context_t context;
+  pcomm_context_t *c = &context;
+  struct timer_probe ticks = { .fired = 0, .limit = 0 };
+  int correct = 1;
+  int i;
+
+  group(t, "offload pool");
+
+  memset(&offloads, 0, sizeof(offloads));
+  offloads.loop_thread = pthread_self();
+
+  pcomm_init(c);
+  test(t, "offload requires a job", pcomm_offload(c, NULL, NULL, NULL) == PCOMM_NULL_JOB);
+  test(t, "pool size can be set", pcomm_set_offload_threads(c, 4) == PCOMM_SUCCESS);
+  test(t, "pool has the requested workers", c->offload.size == 4);
+
+  pcomm_set_blocking(c, 1);
+  pcomm_timer_add(c, 2, 2, on_probe_timer, &ticks, NULL);
+  for (i = 0; i < OFFLOAD_JOBS; i++) {
+    pcomm_offload(c, on_offload_job, on_offload_done, &offloads.results[i]);
+  }
+  test(t, "offloaded jobs are outstanding", c->offload.outstanding == OFFLOAD_JOBS);
+  pcomm_main(c);
+  for (i = 0; i < OFFLOAD_JOBS; i++) {
+    correct = correct && (offloads.results[i] == i * 2);
+  }
+  test(t, "every job ran and completed", offloads.completed == OFFLOAD_JOBS && correct);
+  test(t, "jobs ran off the loop thread", offloads.on_loop == 0);
+  test(t, "completions ran on the loop thread", offloads.off_loop == 0);
+  test(t, "the loop kept serving timers while jobs ran", ticks.fired > 2);
+  pcomm_destroy(c);
+  test(t, "pool is stopped post destroy", c->offload.threads == NULL);
+
+  group(t, NULL);
+}
+
+#define STEAL_JOBS 20
+
+struct {
+  int completed;
+  int long_position;
+} steals;
+
+void on_long_job(void *arg) {
+  struct timespec work = { .tv_sec = 0, .tv_nsec = 100 * MILLISECOND };
+  nanosleep(&work, NULL);
+}
+
+void on_short_job(void *arg) {
+  struct timespec work = { .tv_sec = 0, .tv_nsec = 1 * MILLISECOND };
+  nanosleep(&work, NULL);
+}
+
+void on_steal_done(pcomm_context_t *context, void *arg) {
+  steals.completed++;
+  if (arg) {
+    steals.long_position = steals.completed;
+  }
+  if (steals.completed == STEAL_JOBS + 1) {
+    pcomm_stop(context, 1);
+  }
+}
+
+void test_work_stealing(struct test_context *t) {
+  pcomm_context_t context;
+  pcomm_context_t *c = &context;
+  int i;
+
+  group(t, "work stealing");
+
+  memset(&steals, 0, sizeof(steals));
+
+  pcomm_init(c);
+  pcomm_set_offload_threads(c, 2);
+  test(t, "each worker owns a deque", c->offload.deques != NULL && c->offload.capacity == 2);
+
+  // the long job lands on the first deque and half the short ones behind it
+  pcomm_offload(c, on_long_job, on_steal_done, &steals);
+  for (i = 0; i < STEAL_JOBS; i++) {
+    pcomm_offload(c, on_short_job, on_steal_done, NULL);
+  }
+  pcomm_main(c);
+  test(t, "every job completed", steals.completed == STEAL_JOBS + 1);
+  test(t, "short jobs were stolen from behind the long one",
+       steals.long_position == STEAL_JOBS + 1);
+  test(t, "no jobs remain queued", c->offload.queued == 0);
+  pcomm_destroy(c);
+  test(t, "deques are freed post destroy", c->offload.deques == NULL);
+
+  group(t, NULL);
+}
+
+void test_fd_stats(struct test_context *t) {
+  pcomm_context_t context;
+  pcomm_context_t *c = &context;
+  struct timer_probe once = { .fired = 0, .limit = 1 };
+  pcomm_fd_stats_t stats;
+  pcomm_fd_rank_t top[2];
+  uint8_t payload[1000];
+  int pipes[3][2];
+  int sizes[3] = { 10, 1000, 100 };
+  int i;
+
+  group(t, "per-fd counters");
+
+  memset(payload, 'x', sizeof(payload));
+  pcomm_init(c);
+  for (i = 0; i < 3; i++) {
+    pipe(pipes[i]);
+    write(pipes[i][1], payload, sizes[i]);
+    pcomm_add_read_fd(c, pipes[i][0], on_ignore_io, NULL);
+  }
+  pcomm_add_write_fd(c, pipes[0][1], payload, 10, NULL, NULL);
+  pcomm_add_write_fd(c, pipes[0][1], payload, 20, NULL, NULL);
+  pcomm_get_fd_stats(c, PCOMM_STREAM_WRITE, pipes[0][1], &stats);
+  test(t, "write queue high-water mark is kept", stats.write_queue_max == 30);
+  test(t, "fd stats need a registered fd",
+       pcomm_get_fd_stats(c, PCOMM_STREAM_WRITE, pipes[1][1], &stats) == PCOMM_FD_NOT_FOUND);
+
+  pcomm_set_histograms(c, 1);
+  pcomm_timer_add(c, 20, 0, on_probe_timer, &once, NULL);
+  pcomm_main(c);
+
+  pcomm_get_fd_stats(c, PCOMM_STREAM_READ, pipes[1][0], &stats);
+  test(t, "bytes in are counted per fd", stats.bytes_in == 1000 && stats.reads > 0);
+  test(t, "callback time is charged to the fd", stats.callback_ns > 0);
+  pcomm_get_fd_stats(c, PCOMM_STREAM_READ, pipes[0][0], &stats);
+  test(t, "queued writes reach the reader", stats.bytes_in == 40);
+
+  test(t, "top fds needs room", pcomm_top_fds(c, PCOMM_FD_METRIC_BYTES_IN, top, 0) == 0);
+  test(t, "top fds fills at most n", pcomm_top_fds(c, PCOMM_FD_METRIC_BYTES_IN, top, 2) == 2);
+  test(t, "heaviest fd comes first", top[0].fd == pipes[1][0] && top[0].value == 1000);
+  test(t, "then the next heaviest", top[1].fd == pipes[2][0] && top[1].value == 100);
+  test(t, "ranking reports the stream", top[0].stream == PCOMM_STREAM_READ);
+  pcomm_destroy(c);
+  for (i = 0; i < 3; i++) {
+    close(pipes[i][0]);
+    close(pipes[i][1]);
+  }
+
+  group(t, NULL);
+}
+
+// Collects watchdog reports.
+struct stall_probe {
+  int reports;
+  pcomm_stall_t first;
+};
+
+void on_stall(pcomm_context_t *context, const pcomm_stall_t *stall) {
+  struct stall_probe *probe = (struct stall_probe *)context->external_context;
+
+  if (probe->reports++ == 0) {
+    probe->first = *stall;
+  }
+}
+
+void on_stuck_timer(pcomm_context_t *context, pcomm_timer_t *timer, void *arg) {
+  struct timespec work = { .tv_sec = 0, .tv_nsec = 100 * MILLISECOND };
+
+  nanosleep(&work, NULL);
+}
+
+// Drives the loop one pass at a time until the probe's timer has fired.
+void run_until_fired(pcomm_context_t *c, struct timer_probe *probe) {
+  while (!probe->fired && pcomm_run_once(c, 50) == PCOMM_SUCCESS) {
+  }
+}
+
+void test_watchdog(struct test_context *t) {
+  pcomm_context_t context;
+  pcomm_context_t *c = &context;
+  struct timer_probe idle = { .fired = 0, .limit = 0 };
+  struct timer_probe stuck = { .fired = 0, .limit = 0 };
+  struct timer_probe after = { .fired = 0, .limit = 0 };
+  struct stall_probe probe = { .reports = 0 };
+  struct sigaction action;
+
+  group(t, "watchdog");
+
+  signal(PCOMM_WATCHDOG_SIGNAL, SIG_IGN);
+  pcomm_init(c);
+  c->external_context = &probe;
+  test(t, "watchdog needs a context", pcomm_set_watchdog(NULL, 20, on_stall) == PCOMM_NULL_CONTEXT);
+  test(t, "watchdog starts", pcomm_set_watchdog(c, 20, on_stall) == PCOMM_SUCCESS);
+  pcomm_timer_add(c, 150, 0, on_probe_timer, &idle, NULL);
+  run_until_fired(c, &idle);
+  test(t, "an idle loop is not a stall", idle.fired == 1 && probe.reports == 0);
+  test(t, "a thread that left the loop is no longer watched",
+       !c->watchdog.loop_known && !c->watchdog.busy_since);
+
+  pcomm_timer_add(c, 10, 0, on_stuck_timer, NULL, NULL);
+  pcomm_timer_add(c, 200, 0, on_probe_timer, &stuck, NULL);
+  run_until_fired(c, &stuck);
+  test(t, "watchdog stops", pcomm_set_watchdog(c, 0, NULL) == PCOMM_SUCCESS);
+  sigaction(PCOMM_WATCHDOG_SIGNAL, NULL, &action);
+  test(t, "the signal's own handler is restored", action.sa_handler == SIG_IGN);
+  test(t, "a slow callback is reported once", probe.reports == 1);
+  test(t, "the stall names the timer", probe.first.running == PCOMM_HIST_TIMER && probe.first.fd == -1);
+  test(t, "the stall is at least the threshold", probe.first.elapsed_ns >= 20 * MILLISECOND);
+  test(t, "the loop thread's stack is captured", probe.first.depth > 0);
+
+  pcomm_timer_add(c, 10, 0, on_stuck_timer, NULL, NULL);
+  pcomm_timer_add(c, 150, 0, on_probe_timer, &after, NULL);
+  run_until_fired(c, &after);
+  test(t, "a stopped watchdog reports nothing", probe.reports == 1);
+  pcomm_set_watchdog(c, 20, on_stall);
+  pcomm_destroy(c);
+  test(t, "destroy stops the watchdog", c->watchdog.running == 0);
+  sigaction(PCOMM_WATCHDOG_SIGNAL, NULL, &action);
+  test(t, "destroy restores the signal's handler", action.sa_handler == SIG_IGN);
+  signal(PCOMM_WATCHDOG_SIGNAL, SIG_DFL);
+
+  group(t, NULL);
+}
+
+// Finds the first record of an event in a dumped trace.
+pcomm_trace_record_t *find_trace(pcomm_trace_record_t *records, size_t n, pcomm_trace_event_t event) {
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    if (records[i].event == event) {
+      return &records[i];
+    }
+  }
+  return NULL;
+}
+
+void test_trace(struct test_context *t) {
+  pcomm_context_t context;
+  pcomm_context_t *c = &context;
+  pcomm_trace_record_t records[64];
+  pcomm_trace_record_t *read_record;
+  pcomm_trace_header_t header;
+  int ordered = 1;
+  int pipe_fds[2];
+  int out[2];
+  size_t n;
+  size_t i;
+
+  group(t, "trace ring");
+
+  pcomm_init(c);
+  test(t, "trace needs a context", pcomm_set_trace(NULL, 16) == PCOMM_NULL_CONTEXT);
+  test(t, "nothing is traced by default", pcomm_trace_dump(c, records, 64) == 0);
+  test(t, "trace is enabled", pcomm_set_trace(c, 50) == PCOMM_SUCCESS);
+  test(t, "capacity rounds up to a power of two", c->trace.mask + 1 == 64);
+
+  pipe(pipe_fds);
+  write(pipe_fds[1], "hello", 5);
+  close(pipe_fds[1]);
+  pcomm_add_read_fd(c, pipe_fds[0], on_ignore_io, NULL);
+  pcomm_main(c);
+  close(pipe_fds[0]);
+
+  n = pcomm_trace_dump(c, records, 64);
+  test(t, "the loop leaves a trace", n > 0);
+  read_record = find_trace(records, n, PCOMM_TRACE_READ);
+  test(t, "reads are traced with fd and bytes",
+       read_record && read_record->fd == pipe_fds[0] && read_record->value == 5);
+  test(t, "the io callback is traced",
+       find_trace(records, n, PCOMM_TRACE_CALLBACK) &&
+       find_trace(records, n, PCOMM_TRACE_CALLBACK)->value == PCOMM_HIST_IO);
+  test(t, "the hang-up close is traced", find_trace(records, n, PCOMM_TRACE_CLOSE) != NULL);
+  for (i = 1; i < n; i++) {
+    ordered &= records[i].ns >= records[i - 1].ns;
+  }
+  test(t, "records come out oldest first", ordered);
+  test(t, "dump honours its limit", pcomm_trace_dump(c, records, 2) == 2 &&
+       records[1].event == records[n - 1].event && records[1].ns == records[n - 1].ns);
+
+  pipe(out);
+  test(t, "trace is written out", pcomm_trace_write(c, out[1]) == PCOMM_SUCCESS);
+  read(out[0], &header, sizeof(header));
+  test(t, "written trace has a header",
+       header.magic == PCOMM_TRACE_MAGIC && header.record_size == sizeof(pcomm_trace_record_t) &&
+       header.count == n);
+  close(out[0]);
+  close(out[1]);
+
+  test(t, "trace is disabled", pcomm_set_trace(c, 0) == PCOMM_SUCCESS);
+  test(t, "a disabled trace dumps nothing", pcomm_trace_dump(c, records, 64) == 0);
+  test(t, "a disabled trace cannot be written", pcomm_trace_write(c, 1) == PCOMM_NULL_BUFFER);
+  pcomm_destroy(c);
 
   group(t, NULL);
 }
@@ -232,6 +1604,26 @@ void run_tests(struct test_context *t) {
   test_init(t);
   test_external_context(t);
   test_debug_mode(t);
+  test_timers(t);
+  test_clock(t);
+  test_blocking(t);
+  test_busy_poll(t);
+  test_wakeup(t);
+  test_post(t);
+  test_run_once(t);
+  test_stats(t);
+  test_histograms(t);
+  test_fd_stats(t);
+  test_watchdog(t);
+  test_trace(t);
+  test_signals(t);
+  test_reactor_group(t);
+  test_offload(t);
+  test_work_stealing(t);
+  test_timer_fds(t);
+  test_fd_timeouts(t);
+  test_self_removal(t);
+  test_write_failure(t);
   test_destroy(t);
 
   group(t, "end");